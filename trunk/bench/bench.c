@@ -0,0 +1,392 @@
+/* #######################################################################
+    Copyright 2011 Oscar Amoros Huguet, Cristian Garcia Marin
+
+    This file is part of SimpleOpenCL
+
+    SimpleOpenCL is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 3.
+
+    SimpleOpenCL is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SimpleOpenCL. If not, see <http://www.gnu.org/licenses/>.
+
+   #######################################################################
+
+   SimpleOpenCL benchmark suite.
+
+   Measures the library paths that matter for performance:
+     launch     empty kernel through sclLaunchKernel and sclEnqueueKernel
+     write/read sclWrite and sclRead bandwidth for several sizes
+     managed    sclManageArgsLaunchKernel against the same work written by hand,
+                with zero-copy buffers in both on unified memory devices
+     build      sclGetCLSoftware from source, from the binary cache and from
+                the program registry
+
+   It uses the first CPU device (POCL, Intel, AMD) unless -gpu is given.
+   Results are written as CSV, or JSON with -json, to bench_results.csv
+   (bench_results.json) or to the file given with -o.
+
+   Usage: ./bench [-gpu] [-json] [-o file] [-k kernels.cl] [-n iterations]
+
+*/
+
+#include "../simpleCL.h"
+
+typedef struct {
+	char benchmark[32];
+	char variant[48];
+	size_t bytes;
+	int iterations;
+	double mean;
+	double min;
+	double max;
+	double bandwidth;
+} benchResult;
+
+static benchResult* results = NULL;
+static int nResults = 0;
+
+double benchTime( void ) {
+	struct timeval tv;
+
+	gettimeofday( &tv, NULL );
+
+	return (double)tv.tv_sec * 1e6 + (double)tv.tv_usec;
+}
+
+/* Stores the statistics of "iterations" samples, in microseconds */
+void benchStore( const char* benchmark, const char* variant, size_t bytes, double* samples, int iterations ) {
+	benchResult* r;
+	int i;
+
+	results = (benchResult*)realloc( results, ( nResults + 1 ) * sizeof(benchResult) );
+	r = &results[ nResults++ ];
+	snprintf( r->benchmark, sizeof(r->benchmark), "%s", benchmark );
+	snprintf( r->variant, sizeof(r->variant), "%s", variant );
+	r->bytes = bytes;
+	r->iterations = iterations;
+	r->mean = 0.0;
+	r->min = samples[0];
+	r->max = samples[0];
+	for ( i = 0; i < iterations; ++i ) {
+		r->mean += samples[i];
+		if ( samples[i] < r->min ) { r->min = samples[i]; }
+		if ( samples[i] > r->max ) { r->max = samples[i]; }
+	}
+	r->mean /= iterations;
+	r->bandwidth = bytes > 0 && r->mean > 0.0 ? (double)bytes / r->mean * 1e-3 : 0.0;
+
+	fprintf( stderr, "%-10s %-28s %10lu bytes %10.2f us\n", benchmark, variant, (unsigned long)bytes, r->mean );
+}
+
+void benchLaunch( sclHard hardware, sclSoft empty, int iterations, double* samples ) {
+	size_t global[2] = { 64, 1 };
+	cl_event event;
+	double start;
+	int i;
+
+	sclLaunchKernel( hardware, empty, global, NULL );
+
+	for ( i = 0; i < iterations; ++i ) {
+		start = benchTime();
+		event = sclLaunchKernel( hardware, empty, global, NULL );
+		samples[i] = benchTime() - start;
+		sclReleaseEvent( event );
+	}
+	benchStore( "launch", "sclLaunchKernel", 0, samples, iterations );
+
+	/* Enqueue cost of every call, the device runs them behind */
+	for ( i = 0; i < iterations; ++i ) {
+		start = benchTime();
+		event = sclEnqueueKernel( hardware, empty, global, NULL );
+		samples[i] = benchTime() - start;
+		sclReleaseEvent( event );
+	}
+	sclFinish( hardware );
+	benchStore( "launch", "sclEnqueueKernel", 0, samples, iterations );
+
+	/* Whole batch, including the final sclFinish, per kernel */
+	start = benchTime();
+	for ( i = 0; i < iterations; ++i ) {
+		sclReleaseEvent( sclEnqueueKernel( hardware, empty, global, NULL ) );
+	}
+	sclFinish( hardware );
+	samples[0] = ( benchTime() - start ) / iterations;
+	benchStore( "launch", "sclEnqueueKernel+sclFinish", 0, samples, 1 );
+}
+
+void benchTransfers( sclHard hardware, int iterations, double* samples ) {
+	size_t sizes[] = { 4096, 65536, 1048576, 16777216, 67108864 };
+	char variant[48];
+	unsigned char* host;
+	cl_mem buffer;
+	double start;
+	int s, i, n;
+
+	for ( s = 0; s < (int)( sizeof(sizes) / sizeof(sizes[0]) ); ++s ) {
+		if ( sizes[s] > hardware.maxPointerSize ) {
+			break;
+		}
+		host = (unsigned char*)malloc( sizes[s] );
+		memset( host, 1, sizes[s] );
+		buffer = sclMalloc( hardware, CL_MEM_READ_WRITE, sizes[s] );
+		/* Big copies need fewer samples */
+		n = sizes[s] >= 16777216 ? ( iterations < 10 ? iterations : 10 ) : iterations;
+
+		sclWrite( hardware, sizes[s], buffer, host );
+		for ( i = 0; i < n; ++i ) {
+			start = benchTime();
+			sclWrite( hardware, sizes[s], buffer, host );
+			samples[i] = benchTime() - start;
+		}
+		snprintf( variant, sizeof(variant), "sclWrite" );
+		benchStore( "write", variant, sizes[s], samples, n );
+
+		for ( i = 0; i < n; ++i ) {
+			start = benchTime();
+			sclRead( hardware, sizes[s], buffer, host );
+			samples[i] = benchTime() - start;
+		}
+		snprintf( variant, sizeof(variant), "sclRead" );
+		benchStore( "read", variant, sizes[s], samples, n );
+
+		sclReleaseMemObject( buffer );
+		free( host );
+	}
+}
+
+void benchManaged( sclHard hardware, sclSoft vadd, int iterations, double* samples ) {
+	size_t sizes[] = { 4096, 1048576 };
+	size_t global[2], bytes;
+	float *a, *b, *c;
+	void *mapped;
+	cl_mem bufA, bufB, bufC;
+	cl_event event;
+	double start;
+	int s, i;
+
+	for ( s = 0; s < (int)( sizeof(sizes) / sizeof(sizes[0]) ); ++s ) {
+		bytes = sizes[s];
+		global[0] = bytes / sizeof(float);
+		global[1] = 1;
+		/* Page-aligned, so the zero-copy path can use the arrays in place */
+		a = b = c = NULL;
+		if ( posix_memalign( (void**)&a, 4096, bytes ) != 0 || posix_memalign( (void**)&b, 4096, bytes ) != 0 ||
+				posix_memalign( (void**)&c, 4096, bytes ) != 0 ) {
+			fprintf( stderr, "\nError allocating %lu bytes\n", (unsigned long)bytes );
+			free( a );
+			free( b );
+			free( c );
+			return;
+		}
+		for ( i = 0; i < (int)global[0]; ++i ) {
+			a[i] = (float)i;
+			b[i] = 1.0f;
+		}
+
+		for ( i = 0; i < iterations; ++i ) {
+			start = benchTime();
+			event = sclManageArgsLaunchKernel( hardware, vadd, global, NULL, "%r%r%w",
+							   bytes, a, bytes, b, bytes, c );
+			samples[i] = benchTime() - start;
+			sclReleaseEvent( event );
+		}
+		benchStore( "managed", "sclManageArgsLaunchKernel", 3 * bytes, samples, iterations );
+
+		for ( i = 0; i < iterations; ++i ) {
+			start = benchTime();
+			if ( hardware.unifiedMemory ) {
+				/* The path sclManageArgsLaunchKernel takes on this device */
+				bufA = sclMallocHost( hardware, CL_MEM_READ_ONLY, bytes, a );
+				bufB = sclMallocHost( hardware, CL_MEM_READ_ONLY, bytes, b );
+				bufC = sclMallocHost( hardware, CL_MEM_WRITE_ONLY, bytes, c );
+			}
+			else {
+				bufA = sclMallocWrite( hardware, CL_MEM_READ_ONLY, bytes, a );
+				bufB = sclMallocWrite( hardware, CL_MEM_READ_ONLY, bytes, b );
+				bufC = sclMalloc( hardware, CL_MEM_WRITE_ONLY, bytes );
+			}
+			sclSetKernelArg( vadd, 0, sizeof(cl_mem), &bufA );
+			sclSetKernelArg( vadd, 1, sizeof(cl_mem), &bufB );
+			sclSetKernelArg( vadd, 2, sizeof(cl_mem), &bufC );
+			event = sclEnqueueKernel( hardware, vadd, global, NULL );
+			if ( hardware.unifiedMemory ) {
+				mapped = sclMap( hardware, bufC, CL_MAP_READ, 0, bytes );
+				if ( mapped != NULL ) {
+					if ( mapped != (void*)c ) {
+						memcpy( c, mapped, bytes );
+					}
+					sclUnmap( hardware, bufC, mapped );
+				}
+			}
+			else {
+				sclRead( hardware, bytes, bufC, c );
+			}
+			sclReleaseMemObject( bufA );
+			sclReleaseMemObject( bufB );
+			sclReleaseMemObject( bufC );
+			samples[i] = benchTime() - start;
+			sclReleaseEvent( event );
+		}
+		benchStore( "managed", hardware.unifiedMemory ? "hand-written (zero-copy)" : "hand-written", 3 * bytes,
+			    samples, iterations );
+
+		free( a );
+		free( b );
+		free( c );
+	}
+}
+
+void benchBuild( sclHard hardware, char* kernels, int iterations, double* samples ) {
+	sclSoft software, held;
+	double start;
+	int i, n;
+
+	/* A private cache directory, so the user cache is not touched */
+	sclSetBinaryCacheDir( "bench_cache" );
+	n = iterations < 10 ? iterations : 10;
+
+	for ( i = 0; i < n; ++i ) {
+		sclInvalidateBinaryCache();
+		start = benchTime();
+		software = sclGetCLSoftware( kernels, "bench_vadd", hardware );
+		samples[i] = benchTime() - start;
+		sclReleaseClSoft( software );
+	}
+	benchStore( "build", "cold (source)", 0, samples, n );
+
+	for ( i = 0; i < n; ++i ) {
+		start = benchTime();
+		software = sclGetCLSoftware( kernels, "bench_vadd", hardware );
+		samples[i] = benchTime() - start;
+		sclReleaseClSoft( software );
+	}
+	benchStore( "build", "warm (binary cache)", 0, samples, n );
+
+	held = sclGetCLSoftware( kernels, "bench_vadd", hardware );
+	for ( i = 0; i < iterations; ++i ) {
+		start = benchTime();
+		software = sclGetCLSoftware( kernels, "bench_vadd", hardware );
+		samples[i] = benchTime() - start;
+		sclReleaseClSoft( software );
+	}
+	benchStore( "build", "warm (program registry)", 0, samples, iterations );
+	sclReleaseClSoft( held );
+
+	sclInvalidateBinaryCache();
+	rmdir( "bench_cache" );
+	sclSetBinaryCacheDir( NULL );
+}
+
+int benchWrite( const char* filename, int json, const char* deviceName ) {
+	FILE* out;
+	int i;
+
+	out = fopen( filename, "w" );
+	if ( out == NULL ) {
+		fprintf( stderr, "\nError writing %s\n", filename );
+		return 1;
+	}
+	if ( json ) {
+		fprintf( out, "{\"device\":\"%s\",\"results\":[", deviceName );
+		for ( i = 0; i < nResults; ++i ) {
+			fprintf( out, "%s\n{\"benchmark\":\"%s\",\"variant\":\"%s\",\"bytes\":%lu,\"iterations\":%d,"
+				 "\"mean_us\":%.3f,\"min_us\":%.3f,\"max_us\":%.3f,\"gbps\":%.3f}", i > 0 ? "," : "",
+				 results[i].benchmark, results[i].variant, (unsigned long)results[i].bytes, results[i].iterations,
+				 results[i].mean, results[i].min, results[i].max, results[i].bandwidth );
+		}
+		fprintf( out, "\n]}\n" );
+	}
+	else {
+		fprintf( out, "device,benchmark,variant,bytes,iterations,mean_us,min_us,max_us,gbps\n" );
+		for ( i = 0; i < nResults; ++i ) {
+			fprintf( out, "\"%s\",%s,%s,%lu,%d,%.3f,%.3f,%.3f,%.3f\n", deviceName, results[i].benchmark,
+				 results[i].variant, (unsigned long)results[i].bytes, results[i].iterations,
+				 results[i].mean, results[i].min, results[i].max, results[i].bandwidth );
+		}
+	}
+	fclose( out );
+	fprintf( stderr, "\nResults written to %s\n", filename );
+
+	return 0;
+}
+
+int main( int argc, char *argv[] ) {
+	sclHard* hardware;
+	sclHard device;
+	sclSoft empty, vadd;
+	char* kernels = "bench.cl";
+	const char* output = NULL;
+	char deviceName[1024];
+	cl_device_type wanted = CL_DEVICE_TYPE_CPU;
+	double* samples;
+	int i, found = 0, json = 0, iterations = 100;
+
+	for ( i = 1; i < argc; ++i ) {
+		if ( strcmp( argv[i], "-gpu" ) == 0 ) {
+			wanted = CL_DEVICE_TYPE_GPU;
+		}
+		else if ( strcmp( argv[i], "-json" ) == 0 ) {
+			json = 1;
+		}
+		else if ( strcmp( argv[i], "-o" ) == 0 && i + 1 < argc ) {
+			output = argv[ ++i ];
+		}
+		else if ( strcmp( argv[i], "-k" ) == 0 && i + 1 < argc ) {
+			kernels = argv[ ++i ];
+		}
+		else if ( strcmp( argv[i], "-n" ) == 0 && i + 1 < argc ) {
+			iterations = atoi( argv[ ++i ] );
+		}
+		else {
+			fprintf( stderr, "Usage: %s [-gpu] [-json] [-o file] [-k kernels.cl] [-n iterations]\n", argv[0] );
+			return 1;
+		}
+	}
+	if ( iterations < 1 ) {
+		iterations = 1;
+	}
+	if ( output == NULL ) {
+		output = json ? "bench_results.json" : "bench_results.csv";
+	}
+
+	hardware = sclGetAllHardware( &found );
+	if ( found == 0 ) {
+		return 1;
+	}
+	device = hardware[0];
+	for ( i = 0; i < found; ++i ) {
+		if ( hardware[i].deviceType & wanted ) {
+			device = hardware[i];
+			break;
+		}
+	}
+	deviceName[0] = '\0';
+	clGetDeviceInfo( device.device, CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL );
+	fprintf( stderr, "\nBenchmarking device %d: %s\n", device.devNum, deviceName );
+
+	samples = (double*)malloc( iterations * sizeof(double) );
+
+	benchBuild( device, kernels, iterations, samples );
+
+	empty = sclGetCLSoftware( kernels, "bench_empty", device );
+	vadd  = sclGetCLSoftware( kernels, "bench_vadd", device );
+
+	benchLaunch( device, empty, iterations, samples );
+	benchTransfers( device, iterations, samples );
+	benchManaged( device, vadd, iterations, samples );
+
+	sclReleaseClSoft( empty );
+	sclReleaseClSoft( vadd );
+	free( samples );
+
+	i = benchWrite( output, json, deviceName );
+	free( results );
+
+	return i;
+}
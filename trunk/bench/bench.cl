@@ -0,0 +1,10 @@
+/* SimpleOpenCL benchmark kernels */
+
+__kernel void bench_empty() {
+}
+
+__kernel void bench_vadd( __global const float* a, __global const float* b, __global float* c ) {
+	int i = get_global_id(0);
+
+	c[i] = a[i] + b[i];
+}
@@ -236,787 +236,4856 @@ cl_program _sclCreateProgram( char* program_source, cl_context context )
 	return program;
 }
 
-void _sclBuildProgram( cl_program program, cl_device_id devices, const char* pName )
+/* Programs are built for all their devices: only the device of the sclHard in
+   a context of its own, every device of the group in a shared context, so the
+   sclSoft also works on the other devices of the context. */
+cl_int _sclBuildProgram( cl_program program, cl_device_id device, const char* options, const char* pName )
 {
-#ifdef DEBUG
 	cl_int err;
+#ifdef DEBUG
 	char build_c[4096];
 	
-	err = clBuildProgram( program, 0, NULL, NULL, NULL, NULL );
+	err = clBuildProgram( program, 0, NULL, options, NULL, NULL );
    	if ( err != CL_SUCCESS ) {
 		fprintf( stderr,  "Error on buildProgram " );
 		sclPrintErrorFlags( err ); 
 		fprintf( stderr,  "\nRequestingInfo\n" );
-		clGetProgramBuildInfo( program, devices, CL_PROGRAM_BUILD_LOG, 4096, build_c, NULL );
+		clGetProgramBuildInfo( program, device, CL_PROGRAM_BUILD_LOG, 4096, build_c, NULL );
 		fprintf( stderr,  "Build Log for %s_program:\n%s\n", pName, build_c );
 	}
 #else
-	clBuildProgram( program, 0, NULL, NULL, NULL, NULL );
+	err = clBuildProgram( program, 0, NULL, options, NULL, NULL );
 #endif
 
+	return err;
 }
 
-cl_kernel _sclCreateKernel( sclSoft software ) {
-	cl_kernel kernel;
-#ifdef DEBUG
-	cl_int err;
+cl_uint _sclGetContextDeviceCount( cl_context context ) {
+	cl_uint nDevices = 1;
 
-	kernel = clCreateKernel( software.program, software.kernelName, &err );
-	if ( err != CL_SUCCESS ) {
-		fprintf( stderr,  "Error on createKernel %s ", software.kernelName );
-		sclPrintErrorFlags( err );
+	if ( clGetContextInfo( context, CL_CONTEXT_NUM_DEVICES, sizeof(cl_uint), &nDevices, NULL ) != CL_SUCCESS ) {
+		return 1;
 	}
-#else
-	kernel = clCreateKernel( software.program, software.kernelName, NULL );
-#endif
 
-	return kernel;
+	return nDevices;
 }
 
-cl_event sclLaunchKernel( sclHard hardware, sclSoft software, size_t *global_work_size, size_t *local_work_size) {
-	cl_event myEvent=NULL;	
-#ifdef DEBUG
-	cl_int err;
+/* Program binary cache. Built programs are stored under _sclBinaryCacheDir as
+   scl_<key>.bin, where the key hashes the source, the build options, the device
+   name and the driver version. The directory is taken from SCL_CACHE_DIR, or
+   $HOME/.sclcache if it is not set. An empty SCL_CACHE_DIR disables the cache. */
+
+static char _sclBinaryCacheDir[1024];
+static int _sclBinaryCacheInit = 0;
+static unsigned long _sclBinaryCacheHits = 0;
+static unsigned long _sclBinaryCacheMisses = 0;
+static pthread_mutex_t _sclBinaryCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+const char* _sclGetBinaryCacheDir( void ) {
+	const char* env;
+
+	if ( !_sclBinaryCacheInit ) {
+		_sclBinaryCacheInit = 1;
+		_sclBinaryCacheDir[0] = '\0';
+		env = getenv( "SCL_CACHE_DIR" );
+		if ( env != NULL ) {
+			snprintf( _sclBinaryCacheDir, sizeof(_sclBinaryCacheDir), "%s", env );
+		}
+		else if ( ( env = getenv( "HOME" ) ) != NULL ) {
+			snprintf( _sclBinaryCacheDir, sizeof(_sclBinaryCacheDir), "%s/.sclcache", env );
+		}
+	}
 
-	err = clEnqueueNDRangeKernel( hardware.queue, software.kernel, 2, NULL, global_work_size, local_work_size, 0, NULL, &myEvent );
-	if ( err != CL_SUCCESS ) {
-		fprintf( stderr,  "\nError on launchKernel %s", software.kernelName );
-		sclPrintErrorFlags(err); }
-#else
-	clEnqueueNDRangeKernel( hardware.queue, software.kernel, 2, NULL, global_work_size, local_work_size, 0, NULL, NULL );
-#endif
-	sclFinish( hardware );
-	return myEvent;
+	return _sclBinaryCacheDir[0] != '\0' ? _sclBinaryCacheDir : NULL;
 }
 
-cl_event sclEnqueueKernel( sclHard hardware, sclSoft software, size_t *global_work_size, size_t *local_work_size) {
-	cl_event myEvent=NULL;	
-#ifdef DEBUG
-	cl_int err;
-
-	err = clEnqueueNDRangeKernel( hardware.queue, software.kernel, 2, NULL, global_work_size, local_work_size, 0, NULL, &myEvent );
-	if ( err != CL_SUCCESS ) {
-		fprintf( stderr,  "\nError on launchKernel %s", software.kernelName );
-		sclPrintErrorFlags(err); }
-#else
-	clEnqueueNDRangeKernel( hardware.queue, software.kernel, 2, NULL, global_work_size, local_work_size, 0, NULL, NULL );
-#endif
-
-	return myEvent;
-		
+void sclSetBinaryCacheDir( const char* dir ) {
+	_sclBinaryCacheInit = 1;
+	snprintf( _sclBinaryCacheDir, sizeof(_sclBinaryCacheDir), "%s", dir != NULL ? dir : "" );
 }
 
-void sclReleaseClSoft( sclSoft soft ) {
-	clReleaseKernel( soft.kernel );
-	clReleaseProgram( soft.program );
+void sclGetBinaryCacheStats( unsigned long* hits, unsigned long* misses ) {
+	pthread_mutex_lock( &_sclBinaryCacheMutex );
+	if ( hits != NULL )   { *hits = _sclBinaryCacheHits; }
+	if ( misses != NULL ) { *misses = _sclBinaryCacheMisses; }
+	pthread_mutex_unlock( &_sclBinaryCacheMutex );
 }
 
-void sclReleaseClHard( sclHard hardware ){
-	clReleaseCommandQueue( hardware.queue );
-	clReleaseContext( hardware.context );
+void sclInvalidateBinaryCache( void ) {
+	const char* dir = _sclGetBinaryCacheDir();
+	DIR* dh;
+	struct dirent* entry;
+	char filename[1300];
+	size_t len;
+
+	if ( dir == NULL || ( dh = opendir( dir ) ) == NULL ) {
+		return;
+	}
+	while ( ( entry = readdir( dh ) ) != NULL ) {
+		len = strlen( entry->d_name );
+		if ( strncmp( entry->d_name, "scl_", 4 ) == 0 && len > 4 &&
+				strcmp( entry->d_name + len - 4, ".bin" ) == 0 ) {
+			snprintf( filename, sizeof(filename), "%s/%s", dir, entry->d_name );
+			remove( filename );
+		}
+	}
+	closedir( dh );
 }
 
-void sclRetainClHard( sclHard hardware ) {
-	clRetainCommandQueue( hardware.queue );
-	clRetainContext( hardware.context );
+cl_ulong _sclHashString( cl_ulong hash, const char* str ) {
+	/* FNV-1a, the terminating zero is hashed too so "ab"+"c" != "a"+"bc" */
+	do {
+		hash ^= (unsigned char)*str;
+		hash *= 1099511628211ULL;
+	} while ( *str++ != '\0' );
+
+	return hash;
 }
 
-void sclReleaseAllHardware ( sclHard* hardList, int found ) {
-	int i;	
+int _sclBinaryCachePath( char* filename, size_t length, const char* source, const char* options, cl_device_id device ) {
+	const char* dir = _sclGetBinaryCacheDir();
+	char deviceName[1024];
+	char driverVersion[256];
+	const char* fields[4];
+	cl_ulong h1 = 14695981039346656037ULL, h2 = 0x84222325cbf29ce4ULL;
+	int i;
 
-	for ( i = 0; i < found; ++i ) {
-		sclReleaseClHard( hardList[i] );
+	if ( dir == NULL ) {
+		return 0;
 	}
- 
+	deviceName[0] = '\0';
+	driverVersion[0] = '\0';
+	clGetDeviceInfo( device, CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL );
+	clGetDeviceInfo( device, CL_DRIVER_VERSION, sizeof(driverVersion), driverVersion, NULL );
+
+	fields[0] = source;
+	fields[1] = options != NULL ? options : "";
+	fields[2] = deviceName;
+	fields[3] = driverVersion;
+	for ( i = 0; i < 4; ++i ) {
+		h1 = _sclHashString( h1, fields[i] );
+		h2 = _sclHashString( h2, fields[i] );
+	}
+
+	snprintf( filename, length, "%s/scl_%08lx%08lx%08lx%08lx.bin", dir,
+		  (unsigned long)( h1 >> 32 ), (unsigned long)( h1 & 0xffffffffUL ),
+		  (unsigned long)( h2 >> 32 ), (unsigned long)( h2 & 0xffffffffUL ) );
+
+	return 1;
 }
 
-void sclRetainAllHardware ( sclHard* hardList, int found ) {
-	int i;	
+cl_program _sclLoadProgramBinary( const char* filename, cl_context context, cl_device_id device, const char* options ) {
+	struct stat statbuf;
+	FILE *fh;
+	unsigned char *binary;
+	size_t size;
+	cl_program program;
+	cl_int err, status;
 
-	for ( i = 0; i < found; ++i ) {
-		sclRetainClHard( hardList[i] );
+	if ( stat( filename, &statbuf ) != 0 || ( fh = fopen( filename, "rb" ) ) == NULL ) {
+		return NULL;
 	}
- 
+	size = (size_t)statbuf.st_size;
+	binary = (unsigned char*)malloc( size );
+	if ( binary == NULL || fread( binary, 1, size, fh ) != size ) {
+		fclose( fh );
+		free( binary );
+		return NULL;
+	}
+	fclose( fh );
+
+	program = clCreateProgramWithBinary( context, 1, &device, &size, (const unsigned char**)&binary, &status, &err );
+	free( binary );
+	if ( err != CL_SUCCESS || status != CL_SUCCESS ) {
+		return NULL;
+	}
+	/* A stale binary from another driver is not an error, just a miss */
+	if ( clBuildProgram( program, 1, &device, options, NULL, NULL ) != CL_SUCCESS ) {
+		clReleaseProgram( program );
+		return NULL;
+	}
+
+	return program;
 }
 
-void sclReleaseMemObject( cl_mem object ) {
-	cl_int err;
+void _sclStoreProgramBinary( const char* filename, cl_program program, cl_device_id device ) {
+	cl_uint nDevices, i;
+	cl_device_id *devices;
+	size_t *sizes;
+	unsigned char **binaries;
+	char tmpname[1300];
+	FILE *fh;
 
-	err = clReleaseMemObject( object );
-	if ( err != CL_SUCCESS ) {
-		fprintf( stderr,  "\nError on sclReleaseMemObject" );
-		sclPrintErrorFlags(err); 
-	}	
+	if ( clGetProgramInfo( program, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &nDevices, NULL ) != CL_SUCCESS ) {
+		return;
+	}
+	devices  = (cl_device_id*)malloc( nDevices * sizeof(cl_device_id) );
+	sizes    = (size_t*)malloc( nDevices * sizeof(size_t) );
+	binaries = (unsigned char**)calloc( nDevices, sizeof(unsigned char*) );
+	clGetProgramInfo( program, CL_PROGRAM_DEVICES, nDevices * sizeof(cl_device_id), devices, NULL );
+	clGetProgramInfo( program, CL_PROGRAM_BINARY_SIZES, nDevices * sizeof(size_t), sizes, NULL );
+
+	for ( i = 0; i < nDevices; ++i ) {
+		if ( devices[i] == device && sizes[i] > 0 ) {
+			binaries[i] = (unsigned char*)malloc( sizes[i] );
+			break;
+		}
+	}
+
+	if ( i < nDevices &&
+			clGetProgramInfo( program, CL_PROGRAM_BINARIES, nDevices * sizeof(unsigned char*), binaries, NULL ) == CL_SUCCESS ) {
+		mkdir( _sclGetBinaryCacheDir(), 0755 );
+		/* Write aside and rename so concurrent processes never read a partial file */
+		snprintf( tmpname, sizeof(tmpname), "%s.%ld", filename, (long)getpid() );
+		fh = fopen( tmpname, "wb" );
+		if ( fh != NULL ) {
+			if ( fwrite( binaries[i], 1, sizes[i], fh ) == sizes[i] && fclose( fh ) == 0 ) {
+				rename( tmpname, filename );
+			}
+			else {
+				remove( tmpname );
+			}
+		}
+		free( binaries[i] );
+	}
+	else if ( i < nDevices ) {
+		free( binaries[i] );
+	}
 
+	free( binaries );
+	free( sizes );
+	free( devices );
 }
 
-void sclPrintDeviceNamePlatforms( sclHard* hardList, int found ) {
-	int i;
-	cl_char deviceName[1024];
-	cl_char platformVendor[1024];
-	cl_char platformName[1024];
+cl_program _sclGetCachedProgram( const char* source, const char* options, sclHard hardware, const char* pName ) {
+	cl_program program;
+	char filename[1300];
+	int cached;
+
+	/* Binaries are stored for one device, a shared context needs all of them */
+	cached = _sclGetContextDeviceCount( hardware.context ) == 1 &&
+		 _sclBinaryCachePath( filename, sizeof(filename), source, options, hardware.device );
+
+	if ( cached ) {
+		program = _sclLoadProgramBinary( filename, hardware.context, hardware.device, options );
+		pthread_mutex_lock( &_sclBinaryCacheMutex );
+		if ( program != NULL ) {
+			_sclBinaryCacheHits++;
+		}
+		else {
+			_sclBinaryCacheMisses++;
+		}
+		pthread_mutex_unlock( &_sclBinaryCacheMutex );
+		if ( program != NULL ) {
+			return program;
+		}
+	}
 
-	for ( i = 0; i < found; ++i ) {
-		clGetPlatformInfo( hardList[i].platform, CL_PLATFORM_NAME, sizeof(cl_char)*1024, platformName, NULL );	
-		clGetPlatformInfo( hardList[i].platform, CL_PLATFORM_VENDOR, sizeof(cl_char)*1024, platformVendor, NULL );
-		clGetDeviceInfo( hardList[i].device, CL_DEVICE_NAME, sizeof(cl_char)*1024, deviceName, NULL );
-		fprintf( stdout, "\n Device %d \n Platform name: %s \n Vendor: %s \n Device name: %s", 
-				hardList[i].devNum, platformName, platformVendor, deviceName );	
+	program = _sclCreateProgram( (char*)source, hardware.context );
+	if ( program == NULL ) {
+		return NULL;
+	}
+	/* A program that did not build is never handed out */
+	if ( _sclBuildProgram( program, hardware.device, options, pName ) != CL_SUCCESS ) {
+		clReleaseProgram( program );
+		return NULL;
+	}
+	if ( cached ) {
+		_sclStoreProgramBinary( filename, program, hardware.device );
 	}
 
+	return program;
 }
 
-void sclPrintHardwareStatus( sclHard hardware ) {
-
+cl_kernel _sclCreateKernel( sclSoft software ) {
+	cl_kernel kernel;
+#ifdef DEBUG
 	cl_int err;
-	char platform[100];
-	cl_bool deviceAV;
 
-	err = clGetPlatformInfo( hardware.platform,
-			CL_PLATFORM_NAME,
-			sizeof(char)*100,
-			platform,
-			NULL );
-	if ( err == CL_SUCCESS ) { fprintf( stdout, "\nPlatform object alive" ); }
-	else { sclPrintErrorFlags( err ); }
-	
-	err = clGetDeviceInfo( hardware.device,
-			CL_DEVICE_AVAILABLE,
-			sizeof(cl_bool),
-			(void*)(&deviceAV),
-			NULL );
-	if ( err == CL_SUCCESS && deviceAV ) {
-		fprintf( stdout, "\nDevice object alive and device available." );
-	}
-	else if ( err == CL_SUCCESS ) {
-		fprintf( stdout, "\nDevice object alive and device NOT available.");
+	kernel = clCreateKernel( software.program, software.kernelName, &err );
+	if ( err != CL_SUCCESS ) {
+		fprintf( stderr,  "Error on createKernel %s ", software.kernelName );
+		sclPrintErrorFlags( err );
 	}
-	else {
-		fprintf( stderr, "\nDevice object not alive.");
-	} 
+#else
+	kernel = clCreateKernel( software.program, software.kernelName, NULL );
+#endif
+
+	return kernel;
+}
 
+/* Local work size autotuner. With SCL_AUTOTUNE=1, or after sclSetAutotune( 1 ),
+   a launch with a NULL local size uses the best local size measured for the
+   kernel, its build options, the device and the size class (power of two) of
+   every dimension of the global range. Only kernels enabled with
+   sclSetKernelAutotune are measured: every candidate is timed with the
+   arguments already set, so the kernel must give the same result when it runs
+   several times. Results are kept in memory and appended to the tuning file:
+   SCL_TUNE_FILE, or scl_tuning.txt in the binary cache directory. A local size
+   of 0 means the runtime choice (NULL) was the fastest. */
+
+typedef struct {
+	char kernelName[98];
+	cl_ulong device;
+	cl_ulong options;
+	cl_uint work_dim;
+	int sizeClass[3];
+	size_t local[3];
+} _sclTuneEntry;
+
+static _sclTuneEntry* _sclTuneList = NULL;
+static int _sclTuneListLength = 0, _sclTuneListCapacity = 0;
+static char (*_sclTuneKernels)[98] = NULL;
+static int _sclTuneKernelsLength = 0;
+static int _sclAutotune = -1;
+static int _sclTuneLoaded = 0;
+static int _sclTuneFileSet = 0;
+static char _sclTuneFile[1300];
+static pthread_mutex_t _sclTuneMutex = PTHREAD_MUTEX_INITIALIZER;
+
+void sclSetAutotune( int enable ) {
+	pthread_mutex_lock( &_sclTuneMutex );
+	_sclAutotune = enable != 0;
+	pthread_mutex_unlock( &_sclTuneMutex );
 }
 
-void _sclCreateQueues( sclHard* hardList, int found ) {
+void sclSetTuningFile( const char* filename ) {
+	pthread_mutex_lock( &_sclTuneMutex );
+	snprintf( _sclTuneFile, sizeof(_sclTuneFile), "%s", filename != NULL ? filename : "" );
+	_sclTuneFileSet = 1;
+	/* The results of the old file are dropped, the new one is read on the next lookup */
+	_sclTuneListLength = 0;
+	_sclTuneLoaded = 0;
+	pthread_mutex_unlock( &_sclTuneMutex );
+}
 
+void sclSetKernelAutotune( sclSoft software, int enable ) {
 	int i;
-#ifdef DEBUG
-	cl_int err;
 
-	for ( i = 0; i < found; ++i ) {
-		hardList[i].queue = clCreateCommandQueue( hardList[i].context, hardList[i].device,
-							 CL_QUEUE_PROFILING_ENABLE, &err );
-		if ( err != CL_SUCCESS ) {
-			fprintf( stderr, "\nError creating command queue %d", i );
+	pthread_mutex_lock( &_sclTuneMutex );
+	for ( i = 0; i < _sclTuneKernelsLength; ++i ) {
+		if ( strcmp( _sclTuneKernels[i], software.kernelName ) == 0 ) {
+			break;
 		}
 	}
-#else
-	for ( i = 0; i < found; ++i ) {
-		hardList[i].queue = 
-		clCreateCommandQueue( hardList[i].context, hardList[i].device, NULL, NULL );
+	if ( enable && i == _sclTuneKernelsLength ) {
+		_sclTuneKernels = (char(*)[98])realloc( _sclTuneKernels, ( _sclTuneKernelsLength + 1 ) * sizeof(*_sclTuneKernels) );
+		snprintf( _sclTuneKernels[ _sclTuneKernelsLength++ ], sizeof(*_sclTuneKernels), "%s", software.kernelName );
 	}
-#endif
-
+	else if ( !enable && i < _sclTuneKernelsLength ) {
+		memcpy( _sclTuneKernels[i], _sclTuneKernels[ --_sclTuneKernelsLength ], sizeof(*_sclTuneKernels) );
+	}
+	pthread_mutex_unlock( &_sclTuneMutex );
 }
 
-void _sclSmartCreateContexts( sclHard* hardList, int found ) {
+int _sclKernelAutotuned( const char* kernelName ) {
+	int i, enabled = 0;
 
-	cl_device_id deviceList[16];
-	cl_context context;
-	char var_queries1[1024];
-	char var_queries2[1024];
-#ifdef DEBUG
-	cl_int err;
-#endif
-	ptsclHard groups[10][20];
-	int i, j, groupSet = 0;
-	int groupSizes[10];
-	int nGroups = 0;
+	pthread_mutex_lock( &_sclTuneMutex );
+	for ( i = 0; i < _sclTuneKernelsLength && !enabled; ++i ) {
+		enabled = strcmp( _sclTuneKernels[i], kernelName ) == 0;
+	}
+	pthread_mutex_unlock( &_sclTuneMutex );
 
+	return enabled;
+}
 
-	for ( i = 0; i < found; ++i ) { /* Group generation */
-	
-		clGetPlatformInfo( hardList[i].platform, CL_PLATFORM_NAME, 1024, var_queries1, NULL );
+int _sclAutotuneEnabled( void ) {
+	const char* env;
+	int enabled;
 
-		if (  nGroups == 0 ) {
-			groups[0][0] = &(hardList[0]);
-			nGroups++;
-			groupSizes[0] = 1;
-		}
-		else {
-			groupSet=0;
-			for ( j = 0; j < nGroups; ++j ){
-				clGetPlatformInfo( groups[j][0]->platform, CL_PLATFORM_NAME, 1024, var_queries2, NULL );
-				if ( strcmp( var_queries1, var_queries2 ) == 0 &&
-						hardList[i].deviceType == groups[j][0]->deviceType &&
-						hardList[i].maxPointerSize == groups[j][0]->maxPointerSize ) {
-					groups[j][ groupSizes[j] ] = &(hardList[i]);
-					groupSizes[j]++;
-					groupSet = 1;	
-				}
-			}
-			if ( !groupSet ) {
-				groups[nGroups][0] = &(hardList[i]);
-				groupSizes[nGroups] = 1;
-				nGroups++;
-			}
-		}
+	pthread_mutex_lock( &_sclTuneMutex );
+	if ( _sclAutotune < 0 ) {
+		env = getenv( "SCL_AUTOTUNE" );
+		_sclAutotune = env != NULL && *env != '\0' && strcmp( env, "0" ) != 0;
 	}
+	enabled = _sclAutotune;
+	pthread_mutex_unlock( &_sclTuneMutex );
 
-	for ( i = 0; i < nGroups; ++i ) { /* Context generation */
-	
-		fprintf( stdout, "\nGroup %d with %d devices", i+1, groupSizes[i] );	
-		for ( j = 0; j < groupSizes[i]; ++j ) {
-			deviceList[j] = groups[i][j]->device;	
-		}
-#ifdef DEBUG
-		context = clCreateContext( 0, groupSizes[i], deviceList, NULL, NULL, &err );
-		if ( err != CL_SUCCESS ) {
-			fprintf( stderr, "\nError creating context on device %d", i );
+	return enabled;
+}
+
+const char* _sclGetTuningFile( void ) {
+	const char* env;
+	const char* dir;
+
+	if ( !_sclTuneFileSet ) {
+		_sclTuneFileSet = 1;
+		_sclTuneFile[0] = '\0';
+		if ( ( env = getenv( "SCL_TUNE_FILE" ) ) != NULL ) {
+			snprintf( _sclTuneFile, sizeof(_sclTuneFile), "%s", env );
 		}
-#else
-		context = clCreateContext( 0, groupSizes[i], deviceList, NULL, NULL, NULL );
-#endif
-		for ( j = 0; j < groupSizes[i]; ++j ) {
-			groups[i][j]->context = context;
+		else if ( ( dir = _sclGetBinaryCacheDir() ) != NULL ) {
+			mkdir( dir, 0755 );
+			snprintf( _sclTuneFile, sizeof(_sclTuneFile), "%s/scl_tuning.txt", dir );
 		}
 	}
-}
 
-int _sclGetMaxComputeUnits( cl_device_id device ) {
-	
-	cl_uint nCompU;
+	return _sclTuneFile[0] != '\0' ? _sclTuneFile : NULL;
+}
 
-	clGetDeviceInfo( device, CL_DEVICE_MAX_COMPUTE_UNITS, 4, (void *)&nCompU, NULL );
+cl_ulong _sclGetDeviceHash( cl_device_id device ) {
+	char deviceName[1024];
+	char driverVersion[256];
 
-	return (int)nCompU;	
+	deviceName[0] = '\0';
+	driverVersion[0] = '\0';
+	clGetDeviceInfo( device, CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL );
+	clGetDeviceInfo( device, CL_DRIVER_VERSION, sizeof(driverVersion), driverVersion, NULL );
 
+	return _sclHashString( _sclHashString( 14695981039346656037ULL, deviceName ), driverVersion );
 }
 
-unsigned long int _sclGetMaxMemAllocSize( cl_device_id device ){
-
-	cl_ulong mem;
+cl_ulong _sclGetOptionsHash( sclSoft software, cl_device_id device ) {
+	char options[1024];
 
- 	clGetDeviceInfo( device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, 8, (void *)&mem, NULL );
+	/* Macros in the options may change the best local size */
+	options[0] = '\0';
+	clGetProgramBuildInfo( software.program, device, CL_PROGRAM_BUILD_OPTIONS, sizeof(options), options, NULL );
 
-	return (unsigned long int)mem;	
+	return _sclHashString( 14695981039346656037ULL, options );
+}
 
+void _sclTunePush( _sclTuneEntry entry ) {
+	if ( _sclTuneListLength == _sclTuneListCapacity ) {
+		_sclTuneListCapacity = _sclTuneListCapacity == 0 ? 32 : 2 * _sclTuneListCapacity;
+		_sclTuneList = (_sclTuneEntry*)realloc( _sclTuneList, _sclTuneListCapacity * sizeof(_sclTuneEntry) );
+	}
+	_sclTuneList[ _sclTuneListLength++ ] = entry;
 }
 
-cl_device_type _sclGetDeviceType( cl_device_id device ) {
-	cl_device_type dev_type;
+void _sclLoadTuningFile( void ) {
+	const char* filename = _sclGetTuningFile();
+	_sclTuneEntry entry;
+	unsigned long long device, options;
+	unsigned long local[3];
+	FILE* in;
 
-	clGetDeviceInfo(device,CL_DEVICE_TYPE,sizeof(dev_type),&dev_type,NULL);
-	
-	return dev_type;
+	_sclTuneLoaded = 1;
+	if ( filename == NULL || ( in = fopen( filename, "r" ) ) == NULL ) {
+		return;
+	}
+	while ( fscanf( in, "%97s %llx %llx %u %d %d %d %lu %lu %lu", entry.kernelName, &device, &options, &entry.work_dim,
+			&entry.sizeClass[0], &entry.sizeClass[1], &entry.sizeClass[2],
+			&local[0], &local[1], &local[2] ) == 10 ) {
+		entry.device   = (cl_ulong)device;
+		entry.options  = (cl_ulong)options;
+		entry.local[0] = (size_t)local[0];
+		entry.local[1] = (size_t)local[1];
+		entry.local[2] = (size_t)local[2];
+		_sclTunePush( entry );
+	}
+	fclose( in );
 }
 
-sclHard sclGetFastestDevice( sclHard* hardList, int found ) {
-	int i, maxCpUnits = 0, device = 0;
+void _sclStoreTuning( _sclTuneEntry entry ) {
+	const char* filename;
+	FILE* out;
+
+	pthread_mutex_lock( &_sclTuneMutex );
+	_sclTunePush( entry );
+	filename = _sclGetTuningFile();
+	if ( filename != NULL && ( out = fopen( filename, "a" ) ) != NULL ) {
+		fprintf( out, "%s %llx %llx %u %d %d %d %lu %lu %lu\n", entry.kernelName, (unsigned long long)entry.device,
+			 (unsigned long long)entry.options, entry.work_dim, entry.sizeClass[0], entry.sizeClass[1], entry.sizeClass[2],
+			 (unsigned long)entry.local[0], (unsigned long)entry.local[1], (unsigned long)entry.local[2] );
+		fclose( out );
+	}
+	pthread_mutex_unlock( &_sclTuneMutex );
+}
 
-	for ( i = 0; i < found ; ++i ) {
-		fprintf( stdout, "\nDevice %d Compute Units %d", i, hardList[i].nComputeUnits );
-		if ( maxCpUnits < hardList[i].nComputeUnits ) {
-			device = i;
-			maxCpUnits = hardList[i].nComputeUnits;
+/* Best of three runs, in nanoseconds. Wall time is used if the queue has no
+   profiling. Returns a negative time when the local size is not valid. */
+double _sclTimeLocalSize( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_offset,
+			  size_t *global_work_size, size_t *local_work_size,
+			  cl_uint num_events_in_wait_list, const cl_event *event_wait_list ) {
+	cl_event event;
+	cl_ulong start, end;
+	double best = -1.0, elapsed, wallStart;
+	int i;
+
+	for ( i = 0; i < 3; ++i ) {
+		wallStart = _sclGetWallTime();
+		if ( clEnqueueNDRangeKernel( hardware.queue, software.kernel, work_dim, global_work_offset, global_work_size,
+					     local_work_size, num_events_in_wait_list, event_wait_list, &event ) != CL_SUCCESS ) {
+			return -1.0;
+		}
+		clWaitForEvents( 1, &event );
+		if ( clGetEventProfilingInfo( event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL ) == CL_SUCCESS &&
+				clGetEventProfilingInfo( event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL ) == CL_SUCCESS ) {
+			elapsed = (double)( end - start );
+		}
+		else {
+			elapsed = ( _sclGetWallTime() - wallStart ) * 1e9;
+		}
+		clReleaseEvent( event );
+		if ( best < 0.0 || elapsed < best ) {
+			best = elapsed;
 		}
 	}
 
-	return hardList[ device ];
+	return best;
 }
 
-sclHard* sclGetAllHardware( int* found ) {
+int _sclSizeClass( size_t size ) {
+	int sizeClass = 0;
 
-	int i, j; 
-	cl_uint nPlatforms=0, nDevices=0;
-	
-	*found=0;
+	while ( size > 1 ) {
+		size >>= 1;
+		sizeClass++;
+	}
 
-	cl_platform_id *platforms;
-	cl_int err;
-	cl_device_id *devices;
-	
-	platforms    = (cl_platform_id *) malloc( sizeof(cl_platform_id) * 8 );
-	devices      = (cl_device_id *)   malloc( sizeof(cl_device_id) * 16 );
-	_sclHardList = (sclHard*)         malloc( 16*sizeof(sclHard) );
+	return sizeClass;
+}
 
-	err = clGetPlatformIDs( 8, platforms, &nPlatforms );
-	if ( nPlatforms == 0 ) {
-		fprintf( stderr, "\nNo OpenCL platforms found.\n");
+size_t* _sclTunedLocalSize( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_offset,
+			    size_t *global_work_size, size_t *tuned,
+			    cl_uint num_events_in_wait_list, const cl_event *event_wait_list ) {
+	_sclTuneEntry entry;
+	size_t maxGroup = 0, multiple = 1, maxItems[3] = { 0, 0, 0 }, candidate[3], x, y;
+	double time, best;
+	cl_uint d;
+	int i, measure, found = -1;
+
+	if ( global_work_size == NULL || work_dim < 1 || work_dim > 3 ) {
+		return NULL;
 	}
-	else {
-		
-		for ( i = 0; i < (int)nPlatforms; ++i ) {
-			err = clGetDeviceIDs( platforms[i], CL_DEVICE_TYPE_ALL, 16, devices, &nDevices );
-			if ( nDevices == 0 ) {
-				fprintf( stderr, "\nNo OpenCL enabled device found.");
-				if ( err != CL_SUCCESS ) {
-					fprintf( stderr,  "\nError clGetDeviceIDs" );
-					sclPrintErrorFlags( err );
+	measure = _sclKernelAutotuned( software.kernelName );
+	if ( !measure && !_sclAutotuneEnabled() ) {
+		return NULL;
+	}
+
+	memset( &entry, 0, sizeof(entry) );
+	snprintf( entry.kernelName, sizeof(entry.kernelName), "%s", software.kernelName );
+	entry.device   = _sclGetDeviceHash( hardware.device );
+	entry.options  = _sclGetOptionsHash( software, hardware.device );
+	entry.work_dim = work_dim;
+	for ( d = 0; d < work_dim; ++d ) {
+		entry.sizeClass[d] = _sclSizeClass( global_work_size[d] );
+	}
+
+	pthread_mutex_lock( &_sclTuneMutex );
+	if ( !_sclTuneLoaded ) {
+		_sclLoadTuningFile();
+	}
+	for ( i = 0; i < _sclTuneListLength && found < 0; ++i ) {
+		if ( _sclTuneList[i].device == entry.device && _sclTuneList[i].options == entry.options &&
+				_sclTuneList[i].work_dim == entry.work_dim &&
+				memcmp( _sclTuneList[i].sizeClass, entry.sizeClass, sizeof(entry.sizeClass) ) == 0 &&
+				strcmp( _sclTuneList[i].kernelName, entry.kernelName ) == 0 ) {
+			/* The size class is shared by ranges the stored local size may not divide */
+			found = i;
+			for ( d = 0; d < work_dim && _sclTuneList[i].local[0] != 0; ++d ) {
+				if ( _sclTuneList[i].local[d] == 0 || global_work_size[d] % _sclTuneList[i].local[d] != 0 ) {
+					found = -1;
 				}
 			}
-			else {
-				for ( j = 0; j < (int)nDevices; ++j ) {
-					
-					_sclHardList[ *found ].platform       = platforms[ i ];
-					_sclHardList[ *found ].device         = devices[ j ];
-					_sclHardList[ *found ].nComputeUnits  = _sclGetMaxComputeUnits( _sclHardList[ *found ].device );
-					_sclHardList[ *found ].maxPointerSize = _sclGetMaxMemAllocSize( _sclHardList[ *found ].device );
-					_sclHardList[ *found ].deviceType     = _sclGetDeviceType( _sclHardList[ *found ].device );
-					_sclHardList[ *found ].devNum         = *found;
-					(*found)++;
-				}
-			}
-		}
-		_sclHardListLength = *found;
-		_sclSmartCreateContexts( _sclHardList, *found );
-		_sclCreateQueues( _sclHardList, *found );
-	}
-#ifdef DEBUG
-	sclPrintDeviceNamePlatforms( _sclHardList, *found );
-#endif
-	sclRetainAllHardware( _sclHardList, *found );
-	
-	return _sclHardList;
-
-}
-
-sclHard sclGetGPUHardware( int nDevice, int* found ) {
-	int i;
-	sclHard hardware;
-	cl_int err;
-	int nDevices=0;
-	cl_char vendor_name[1024];
-	cl_char device_name[1024];
-
-	*found = 1;
-
-	for ( i = 0; i < _sclHardListLength; ++i ) {
-		if ( _sclHardList[i].deviceType == CL_DEVICE_TYPE_GPU ) {
-			nDevices++;
-			if ( nDevices-1 == nDevice ) {
-				hardware = _sclHardList[i];
-				break;
-			}
 		}
 	}
-
-	if ( nDevices == 0 ) {
-		fprintf( stderr, "\nNo OpenCL enabled GPU found.\n");
-		*found = 0;
-
-		return hardware;
-	}
-
-	if (nDevice >= nDevices) {
-		fprintf( stderr, "\nNo OpenCL device GPU found.\n");
-		*found = 0;
-
-		return hardware;
+	if ( found >= 0 ) {
+		memcpy( tuned, _sclTuneList[ found ].local, 3 * sizeof(size_t) );
 	}
+	pthread_mutex_unlock( &_sclTuneMutex );
 
-	vendor_name[0] = '\0';
-	device_name[0] = '\0';
-
-	err = (clGetDeviceInfo( hardware.device, CL_DEVICE_VENDOR, sizeof(vendor_name), vendor_name, NULL )
-			 ||clGetDeviceInfo( hardware.device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL ));
-
-	if ( err != CL_SUCCESS ) {
-		fprintf( stderr,  "\nError 2" );
-		sclPrintErrorFlags( err );
+	if ( found < 0 && !measure ) {
+		return NULL;
 	}
+	if ( found < 0 ) {
+		clGetKernelWorkGroupInfo( software.kernel, hardware.device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxGroup, NULL );
+		if ( clGetKernelWorkGroupInfo( software.kernel, hardware.device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+					       sizeof(size_t), &multiple, NULL ) != CL_SUCCESS || multiple == 0 ) {
+			multiple = 1;
+		}
+		clGetDeviceInfo( hardware.device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(maxItems), maxItems, NULL );
 
-	fprintf( stdout, "\nUsing device vendor: %s\nDevice name: %s\n",vendor_name,device_name);
-
-	return hardware;
-}
-
-sclHard sclGetCPUHardware( int nDevice, int* found ) {
-
-	int i;
-	sclHard hardware;
-	cl_int err;
-	int nDevices=0;
-	cl_char vendor_name[1024];
-	cl_char device_name[1024];
-
-	*found = 1;
+		/* The runtime choice is a candidate too */
+		best = _sclTimeLocalSize( hardware, software, work_dim, global_work_offset, global_work_size, NULL,
+					  num_events_in_wait_list, event_wait_list );
+		memset( tuned, 0, 3 * sizeof(size_t) );
 
-	for ( i = 0; i < _sclHardListLength; ++i ) {
-		if ( _sclHardList[i].deviceType == CL_DEVICE_TYPE_CPU ) {
-			nDevices++;
-			if ( nDevices-1 == nDevice ) {
-				hardware = _sclHardList[i];
-				break;
+		/* x: multiples of the preferred size, y: powers of two, z: 1 */
+		for ( x = multiple; x <= maxGroup && ( maxItems[0] == 0 || x <= maxItems[0] ); x *= 2 ) {
+			if ( global_work_size[0] % x != 0 ) {
+				continue;
+			}
+			for ( y = 1; x * y <= maxGroup && ( maxItems[1] == 0 || y <= maxItems[1] ); y *= 2 ) {
+				if ( work_dim > 1 && global_work_size[1] % y != 0 ) {
+					break;
+				}
+				candidate[0] = x;
+				candidate[1] = y;
+				candidate[2] = 1;
+				time = _sclTimeLocalSize( hardware, software, work_dim, global_work_offset, global_work_size, candidate,
+							  num_events_in_wait_list, event_wait_list );
+				if ( time >= 0.0 && ( best < 0.0 || time < best ) ) {
+					best = time;
+					memcpy( tuned, candidate, 3 * sizeof(size_t) );
+				}
+				if ( work_dim == 1 ) {
+					break;
+				}
 			}
 		}
+		memcpy( entry.local, tuned, 3 * sizeof(size_t) );
+		_sclStoreTuning( entry );
 	}
 
-	if ( nDevices == 0 ) {
-		fprintf( stderr, "\nNo OpenCL enabled CPU found.\n");
-		*found = 0;
-
-		return hardware;
-	}
+	return tuned[0] != 0 ? tuned : NULL;
+}
 
-	if (nDevice >= nDevices) {
-		fprintf( stderr, "\nNo OpenCL device CPU found.\n");
-		*found = 0;
+cl_event sclLaunchKernelND( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_offset,
+			     size_t *global_work_size, size_t *local_work_size ) {
+	cl_event myEvent=NULL;	
+	size_t tuned[3];
 
-		return hardware;
+	if ( local_work_size == NULL ) {
+		local_work_size = _sclTunedLocalSize( hardware, software, work_dim, global_work_offset, global_work_size, tuned, 0, NULL );
 	}
+#ifdef DEBUG
+	cl_int err;
 
-	vendor_name[0] = '\0';
-	device_name[0] = '\0';
-
-	err = (clGetDeviceInfo( hardware.device, CL_DEVICE_VENDOR, sizeof(vendor_name), vendor_name, NULL )
-			 ||clGetDeviceInfo( hardware.device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL ));
-
+	err = clEnqueueNDRangeKernel( hardware.queue, software.kernel, work_dim, global_work_offset, global_work_size, local_work_size, 0, NULL, &myEvent );
 	if ( err != CL_SUCCESS ) {
-		fprintf( stderr,  "\nError 2" );
-		sclPrintErrorFlags( err );
-	}
-
-	fprintf( stdout, "\nUsing device vendor: %s\nDevice name: %s\n",vendor_name,device_name);
-
-	return hardware;
+		fprintf( stderr,  "\nError on launchKernel %s", software.kernelName );
+		sclPrintErrorFlags(err); }
+#else
+	clEnqueueNDRangeKernel( hardware.queue, software.kernel, work_dim, global_work_offset, global_work_size, local_work_size, 0, NULL, _sclProfileSlot( &myEvent ) );
+#endif
+	_sclProfileCommand( hardware, myEvent, software.kernelName, "kernel", 0 );
+	sclFinish( hardware );
+	return myEvent;
 }
 
-sclSoft sclGetCLSoftware( char* path, char* name, sclHard hardware ){
-	sclSoft software;
-	/* Load program source
-	 ########################################################### */
-	char *source = _sclLoadProgramSource( path );
-	/* ########################################################### */
-	
-	sprintf( software.kernelName, "%s", name);
-	
-	/* Create program objects from source
-	 ########################################################### */
-	software.program = _sclCreateProgram( source, hardware.context );
-	/* ########################################################### */
-	
-	/* Build the program (compile it)
-   	 ############################################ */
-   	_sclBuildProgram( software.program, hardware.device, name );
-   	/* ############################################ */
-   	
-   	/* Create the kernel object
-	 ########################################################################## */
-	software.kernel = _sclCreateKernel( software );
-	/* ########################################################################## */
-
-	return software;
-	
-}
+cl_event sclEnqueueKernelND( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_offset,
+			      size_t *global_work_size, size_t *local_work_size ) {
+	cl_event myEvent=NULL;	
+	size_t tuned[3];
 
-cl_mem sclMalloc( sclHard hardware, cl_int mode, size_t size ){
-	cl_mem buffer;
+	if ( local_work_size == NULL ) {
+		local_work_size = _sclTunedLocalSize( hardware, software, work_dim, global_work_offset, global_work_size, tuned, 0, NULL );
+	}
 #ifdef DEBUG
 	cl_int err;
-	
-	buffer = clCreateBuffer( hardware.context, mode, size, NULL, &err );
+
+	err = clEnqueueNDRangeKernel( hardware.queue, software.kernel, work_dim, global_work_offset, global_work_size, local_work_size, 0, NULL, &myEvent );
 	if ( err != CL_SUCCESS ) {
-		fprintf( stderr,  "\nclMalloc Error\n" );
-		sclPrintErrorFlags( err );
-	}
+		fprintf( stderr,  "\nError on launchKernel %s", software.kernelName );
+		sclPrintErrorFlags(err); }
 #else
-	buffer = clCreateBuffer( hardware.context, mode, size, NULL, NULL );
+	clEnqueueNDRangeKernel( hardware.queue, software.kernel, work_dim, global_work_offset, global_work_size, local_work_size, 0, NULL, _sclProfileSlot( &myEvent ) );
 #endif
-		
-	return buffer;
-}	
-
-cl_mem sclMallocWrite( sclHard hardware, cl_int mode, size_t size, void* hostPointer ){
-	cl_mem buffer;
+	_sclProfileCommand( hardware, myEvent, software.kernelName, "kernel", 0 );
 
-	buffer = sclMalloc( hardware, mode, size );
+	return myEvent;
+		
+}
 
-#ifdef DEBUG
+cl_event sclEnqueueKernelAsync( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_offset,
+				size_t *global_work_size, size_t *local_work_size,
+				cl_uint num_events_in_wait_list, const cl_event *event_wait_list ) {
+	cl_event myEvent=NULL;	
+	size_t tuned[3];
 	cl_int err;
-	
-	if ( buffer == NULL ) { 
-		fprintf( stderr,  "\nclMallocWrite Error on clCreateBuffer\n" );
+
+	if ( local_work_size == NULL ) {
+		local_work_size = _sclTunedLocalSize( hardware, software, work_dim, global_work_offset, global_work_size, tuned,
+						      num_events_in_wait_list, event_wait_list );
 	}
-	err = clEnqueueWriteBuffer( hardware.queue, buffer, CL_TRUE, 0, size, hostPointer, 0, NULL, NULL );
-	if ( err != CL_SUCCESS ) { 
-		fprintf( stderr,  "\nclMallocWrite Error on clEnqueueWriteBuffer\n" );
-		sclPrintErrorFlags( err );
+	err = clEnqueueNDRangeKernel( hardware.queue, software.kernel, work_dim, global_work_offset, global_work_size, local_work_size,
+				      num_events_in_wait_list, event_wait_list, &myEvent );
+	if ( err != CL_SUCCESS ) {
+		fprintf( stderr,  "\nError on enqueueKernelAsync %s", software.kernelName );
+		sclPrintErrorFlags(err);
+		return NULL;
 	}
+	_sclProfileCommand( hardware, myEvent, software.kernelName, "kernel", 0 );
+	/* Make sure the device starts working while the host goes on */
+	clFlush( hardware.queue );
 
-#else
-	clEnqueueWriteBuffer( hardware.queue, buffer, CL_TRUE, 0, size, hostPointer, 0, NULL, NULL );
-#endif
-	return buffer;
+	return myEvent;
 }
 
-void sclWrite( sclHard hardware, size_t size, cl_mem buffer, void* hostPointer ) {
-#ifdef DEBUG
+cl_int sclSetEventCallback( cl_event event, void (CL_CALLBACK *callback)( cl_event, cl_int, void* ), void* userData ) {
 	cl_int err;
 
-	err = clEnqueueWriteBuffer( hardware.queue, buffer, CL_TRUE, 0, size, hostPointer, 0, NULL, NULL );
-	if ( err != CL_SUCCESS ) { 
-		fprintf( stderr,  "\nclWrite Error\n" );
-		sclPrintErrorFlags( err );
-	}   
-#else
-	clEnqueueWriteBuffer( hardware.queue, buffer, CL_TRUE, 0, size, hostPointer, 0, NULL, NULL );
-#endif
-}
-
-void sclRead( sclHard hardware, size_t size, cl_mem buffer, void *hostPointer ) {
+	err = clSetEventCallback( event, CL_COMPLETE, callback, userData );
 #ifdef DEBUG
-	cl_int err;
-
-	err = clEnqueueReadBuffer( hardware.queue, buffer, CL_TRUE, 0, size, hostPointer, 0, NULL, NULL );
 	if ( err != CL_SUCCESS ) {
-		fprintf( stderr,  "\nclRead Error\n" );
+		fprintf( stderr,  "\nError on sclSetEventCallback" );
 		sclPrintErrorFlags( err );
-       	}
-#else
-	clEnqueueReadBuffer( hardware.queue, buffer, CL_TRUE, 0, size, hostPointer, 0, NULL, NULL );
+	}
 #endif
+
+	return err;
 }
 
-cl_int sclFinish( sclHard hardware ){
-#ifdef DEBUG
+cl_int sclWaitForEvents( cl_uint num_events, const cl_event *event_list ) {
 	cl_int err;
 
-	err = clFinish( hardware.queue );
+	err = clWaitForEvents( num_events, event_list );
+#ifdef DEBUG
 	if ( err != CL_SUCCESS ) {
-		fprintf( stderr,  "\nError clFinish\n" );
+		fprintf( stderr,  "\nError on sclWaitForEvents" );
 		sclPrintErrorFlags( err );
 	}
-#else
-	clFinish( hardware.queue );
 #endif
 
 	return err;
+}
 
+void sclReleaseEvent( cl_event event ) {
+	if ( event != NULL ) {
+		clReleaseEvent( event );
+	}
 }
 
-cl_ulong sclGetEventTime( sclHard hardware, cl_event event ){
+/* Event profiler. With SCL_PROFILE=table or SCL_PROFILE=json every kernel and
+   transfer enqueued by the library gets a completion callback that reads its
+   profiling timestamps, so nothing waits for them. The statistics of every
+   kernel name, and of every transfer function, are written to stderr when the
+   program exits. With SCL_TRACE=file every command is also kept and written
+   to that file as a Chrome trace (chrome://tracing, Perfetto): one process per
+   device and one thread per queue. */
+
+typedef struct {
+	char name[98];
+	unsigned long count;
+	cl_ulong total;
+	cl_ulong min;
+	cl_ulong max;
+	cl_ulong queueWait;
+	cl_ulong submitWait;
+	size_t bytes;
+	cl_ulong* samples;
+	unsigned long capacity;
+} _sclProfileEntry;
+
+typedef struct {
+	char name[98];
+	const char* category;
+	size_t bytes;
+	int devNum;
+	cl_command_queue queue;
+	double hostTime;
+} _sclProfileCommandInfo;
+
+typedef struct {
+	_sclProfileCommandInfo info;
+	cl_ulong queued;
+	cl_ulong submit;
+	cl_ulong start;
+	cl_ulong end;
+} _sclTraceEvent;
+
+static pthread_once_t _sclProfileOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t _sclProfileMutex = PTHREAD_MUTEX_INITIALIZER;
+static int _sclProfileMode = 0;
+static _sclProfileEntry* _sclProfileList = NULL;
+static int _sclProfileListLength = 0, _sclProfileListCapacity = 0;
+static unsigned long _sclProfileLost = 0;
+static char* _sclTracePath = NULL;
+static _sclTraceEvent* _sclTraceList = NULL;
+static int _sclTraceListLength = 0, _sclTraceListCapacity = 0;
+
+void _sclProfileAtExit( void ) {
+	if ( _sclProfileMode != 0 ) {
+		sclProfilerDump( stderr, _sclProfileMode == 2 );
+	}
+	if ( _sclTracePath != NULL ) {
+		sclWriteTrace( _sclTracePath );
+	}
+}
 
-	cl_ulong elapsedTime, startTime, endTime;
+void _sclProfileInit( void ) {
+	const char* mode = getenv( "SCL_PROFILE" );
+	const char* trace = getenv( "SCL_TRACE" );
 
-	sclFinish( hardware );
+	if ( mode != NULL && *mode != '\0' && strcmp( mode, "0" ) != 0 ) {
+		_sclProfileMode = strcmp( mode, "json" ) == 0 ? 2 : 1;
+	}
+	if ( trace != NULL && *trace != '\0' ) {
+		_sclTracePath = _sclStrDup( trace );
+	}
+	if ( _sclProfileMode != 0 || _sclTracePath != NULL ) {
+		atexit( _sclProfileAtExit );
+	}
+}
 
-	clGetEventProfilingInfo( event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &startTime, NULL);
-	clGetEventProfilingInfo( event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &endTime, NULL);
+int _sclProfilerEnabled( void ) {
+	pthread_once( &_sclProfileOnce, _sclProfileInit );
 
-	elapsedTime = endTime-startTime;
+	return _sclProfileMode != 0 || _sclTracePath != NULL;
+}
 
-	return elapsedTime;
+cl_event* _sclProfileSlot( cl_event* event ) {
+	return _sclProfilerEnabled() ? event : NULL;
 }
 
-void sclSetKernelArg( sclSoft software, int argnum, size_t typeSize, void *argument ){
-#ifdef DEBUG
-	cl_int err;
+void _sclProfileRecord( const char* name, size_t bytes, cl_ulong queued, cl_ulong submit, cl_ulong start, cl_ulong end ) {
+	_sclProfileEntry* entry = NULL;
+	cl_ulong elapsed = end - start;
+	int i;
 
-	err = clSetKernelArg( software.kernel, argnum, typeSize, argument );
-	if ( err != CL_SUCCESS ) {	
-		fprintf( stderr,  "\nError clSetKernelArg number %d\n", argnum );
-		sclPrintErrorFlags( err );
+	pthread_mutex_lock( &_sclProfileMutex );
+	for ( i = 0; i < _sclProfileListLength; ++i ) {
+		if ( strcmp( _sclProfileList[i].name, name ) == 0 ) {
+			entry = &_sclProfileList[i];
+			break;
+		}
 	}
-#else
-	clSetKernelArg( software.kernel, argnum, typeSize, argument );
-#endif
-
+	if ( entry == NULL ) {
+		if ( _sclProfileListLength == _sclProfileListCapacity ) {
+			_sclProfileListCapacity = _sclProfileListCapacity == 0 ? 16 : 2 * _sclProfileListCapacity;
+			_sclProfileList = (_sclProfileEntry*)realloc( _sclProfileList,
+								      _sclProfileListCapacity * sizeof(_sclProfileEntry) );
+		}
+		entry = &_sclProfileList[ _sclProfileListLength++ ];
+		memset( entry, 0, sizeof(_sclProfileEntry) );
+		snprintf( entry->name, sizeof(entry->name), "%s", name );
+		entry->min = elapsed;
+	}
+	if ( entry->count == entry->capacity ) {
+		entry->capacity = entry->capacity == 0 ? 64 : 2 * entry->capacity;
+		entry->samples = (cl_ulong*)realloc( entry->samples, entry->capacity * sizeof(cl_ulong) );
+	}
+	entry->samples[ entry->count++ ] = elapsed;
+	entry->total += elapsed;
+	/* Time waiting in the host queue, and time from the device getting it to its start */
+	entry->queueWait  += submit > queued ? submit - queued : 0;
+	entry->submitWait += start > submit ? start - submit : 0;
+	entry->bytes += bytes;
+	if ( elapsed < entry->min ) { entry->min = elapsed; }
+	if ( elapsed > entry->max ) { entry->max = elapsed; }
+	pthread_mutex_unlock( &_sclProfileMutex );
 }
 
-void _sclWriteArgOnAFile( int argnum, void* arg, size_t size, const char* diff ) {
-	FILE *out;
-	char filename[150];
+void _sclTraceRecord( const _sclProfileCommandInfo* info, cl_ulong queued, cl_ulong submit, cl_ulong start, cl_ulong end ) {
+	_sclTraceEvent* event;
 
-	sprintf( filename, "../data/arg%d%s", argnum, diff );
+	pthread_mutex_lock( &_sclProfileMutex );
+	if ( _sclTraceListLength == _sclTraceListCapacity ) {
+		_sclTraceListCapacity = _sclTraceListCapacity == 0 ? 256 : 2 * _sclTraceListCapacity;
+		_sclTraceList = (_sclTraceEvent*)realloc( _sclTraceList, _sclTraceListCapacity * sizeof(_sclTraceEvent) );
+	}
+	event = &_sclTraceList[ _sclTraceListLength++ ];
+	event->info   = *info;
+	event->queued = queued;
+	event->submit = submit;
+	event->start  = start;
+	event->end    = end;
+	pthread_mutex_unlock( &_sclProfileMutex );
+}
 
-	out = fopen( filename, "w+");
+void CL_CALLBACK _sclProfileCallback( cl_event event, cl_int status, void* data ) {
+	_sclProfileCommandInfo* info = (_sclProfileCommandInfo*)data;
+	cl_ulong queued, submit, start, end;
+
+	if ( status == CL_COMPLETE &&
+			clGetEventProfilingInfo( event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued, NULL ) == CL_SUCCESS &&
+			clGetEventProfilingInfo( event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &submit, NULL ) == CL_SUCCESS &&
+			clGetEventProfilingInfo( event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL ) == CL_SUCCESS &&
+			clGetEventProfilingInfo( event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL ) == CL_SUCCESS ) {
+		if ( _sclProfileMode != 0 ) {
+			_sclProfileRecord( info->name, info->bytes, queued, submit, start, end );
+		}
+		if ( _sclTracePath != NULL ) {
+			_sclTraceRecord( info, queued, submit, start, end );
+		}
+	}
+	else {
+		/* Failed command, or a queue without CL_QUEUE_PROFILING_ENABLE */
+		pthread_mutex_lock( &_sclProfileMutex );
+		_sclProfileLost++;
+		pthread_mutex_unlock( &_sclProfileMutex );
+	}
+	clReleaseEvent( event );
+	free( info );
+}
 
-	fwrite( arg, 1, size, out );
+void _sclProfileCommand( sclHard hardware, cl_event event, const char* name, const char* category, size_t bytes ) {
+	_sclProfileCommandInfo* info;
 
-	fclose(out);
+	if ( event == NULL || !_sclProfilerEnabled() ) {
+		return;
+	}
+	info = (_sclProfileCommandInfo*)malloc( sizeof(_sclProfileCommandInfo) );
+	snprintf( info->name, sizeof(info->name), "%s", name );
+	info->category = category;
+	info->bytes    = bytes;
+	info->devNum   = hardware.devNum;
+	info->queue    = hardware.queue;
+	info->hostTime = _sclGetWallTime();
+
+	clRetainEvent( event );
+	if ( clSetEventCallback( event, CL_COMPLETE, _sclProfileCallback, info ) != CL_SUCCESS ) {
+		clReleaseEvent( event );
+		free( info );
+	}
 }
 
- void _sclVSetKernelArgs( sclSoft software, const char *sizesValues, va_list argList ) {
-	const char *p;
-	int argCount = 0;
-	void* argument;
-	size_t actual_size;
-	
-	for( p = sizesValues; *p != '\0'; p++ ) {
-		if ( *p == '%' ) {
-			switch( *++p ) {
-				case 'a':
-					actual_size = va_arg( argList, size_t );
+/* Device timestamps are moved to the host clock with the smallest difference
+   between the host time taken right after an enqueue and the device QUEUED
+   time of that command, computed for every device. Queues become threads in
+   the order they first appear. */
+
+int sclWriteTrace( const char* filename ) {
+	FILE* out;
+	_sclTraceEvent* event;
+	cl_command_queue* queues = NULL;
+	double* offsets = NULL;
+	double offset;
+	char deviceName[1024];
+	int i, j, tid, nQueues = 0, nDevs = 0, first = 1;
+
+	out = fopen( filename, "w" );
+	if ( out == NULL ) {
+		fprintf( stderr, "\nError writing trace file %s\n", filename );
+		return 0;
+	}
+
+	pthread_mutex_lock( &_sclProfileMutex );
+	for ( i = 0; i < _sclTraceListLength; ++i ) {
+		if ( _sclTraceList[i].info.devNum + 1 > nDevs ) {
+			nDevs = _sclTraceList[i].info.devNum + 1;
+		}
+	}
+	offsets = (double*)malloc( ( nDevs > 0 ? nDevs : 1 ) * sizeof(double) );
+	for ( j = 0; j < nDevs; ++j ) {
+		offsets[j] = 0.0;
+		first = 1;
+		for ( i = 0; i < _sclTraceListLength; ++i ) {
+			event = &_sclTraceList[i];
+			if ( event->info.devNum != j ) {
+				continue;
+			}
+			offset = event->info.hostTime * 1e6 - (double)event->queued * 1e-3;
+			if ( first || offset < offsets[j] ) {
+				offsets[j] = offset;
+				first = 0;
+			}
+		}
+	}
+
+	fprintf( out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[" );
+	first = 1;
+	for ( j = 0; j < nDevs; ++j ) {
+		deviceName[0] = '\0';
+		if ( j < _sclHardListLength ) {
+			clGetDeviceInfo( _sclHardList[j].device, CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL );
+		}
+		fprintf( out, "%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"Device %d %s\"}}",
+			 first ? "" : ",", j, j, deviceName );
+		first = 0;
+	}
+	for ( i = 0; i < _sclTraceListLength; ++i ) {
+		event = &_sclTraceList[i];
+		if ( event->info.devNum < 0 ) {
+			continue;
+		}
+		for ( tid = 0; tid < nQueues; ++tid ) {
+			if ( queues[ tid ] == event->info.queue ) {
+				break;
+			}
+		}
+		if ( tid == nQueues ) {
+			queues    = (cl_command_queue*)realloc( queues, ( nQueues + 1 ) * sizeof(cl_command_queue) );
+			queues[ nQueues ] = event->info.queue;
+			nQueues++;
+			fprintf( out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"Queue %d\"}}",
+				 first ? "" : ",", event->info.devNum, tid, tid );
+			first = 0;
+		}
+		fprintf( out, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+			 "\"args\":{\"bytes\":%lu,\"host_submit_us\":%.3f,\"queued_to_submit_us\":%.3f,\"submit_to_start_us\":%.3f}}",
+			 first ? "" : ",", event->info.name, event->info.category, event->info.devNum, tid,
+			 (double)event->start * 1e-3 + offsets[ event->info.devNum ],
+			 (double)( event->end - event->start ) * 1e-3, (unsigned long)event->info.bytes,
+			 event->info.hostTime * 1e6,
+			 event->submit > event->queued ? (double)( event->submit - event->queued ) * 1e-3 : 0.0,
+			 event->start > event->submit ? (double)( event->start - event->submit ) * 1e-3 : 0.0 );
+		first = 0;
+	}
+	fprintf( out, "\n]}\n" );
+	pthread_mutex_unlock( &_sclProfileMutex );
+
+	fclose( out );
+	free( queues );
+	free( offsets );
+
+	return 1;
+}
+
+int _sclCompareTimes( const void* a, const void* b ) {
+	cl_ulong x = *(const cl_ulong*)a, y = *(const cl_ulong*)b;
+
+	return x < y ? -1 : ( x > y ? 1 : 0 );
+}
+
+void sclProfilerDump( FILE* out, int json ) {
+	_sclProfileEntry* entry;
+	cl_ulong p50, p99;
+	int i;
+
+	pthread_mutex_lock( &_sclProfileMutex );
+	if ( json ) {
+		fprintf( out, "{\"profile\":[" );
+	}
+	else {
+		fprintf( out, "\n%-24s %8s %12s %10s %10s %10s %10s %10s %10s %14s\n", "name", "count", "total(ms)", "min(us)",
+			 "max(us)", "p50(us)", "p99(us)", "queue(us)", "submit(us)", "bytes" );
+	}
+	for ( i = 0; i < _sclProfileListLength; ++i ) {
+		entry = &_sclProfileList[i];
+		qsort( entry->samples, entry->count, sizeof(cl_ulong), _sclCompareTimes );
+		p50 = entry->samples[ ( entry->count - 1 ) * 50 / 100 ];
+		p99 = entry->samples[ ( entry->count - 1 ) * 99 / 100 ];
+		if ( json ) {
+			fprintf( out, "%s\n{\"name\":\"%s\",\"count\":%lu,\"total_ns\":%llu,\"min_ns\":%llu,\"max_ns\":%llu,"
+				 "\"p50_ns\":%llu,\"p99_ns\":%llu,\"queue_ns\":%llu,\"submit_ns\":%llu,\"bytes\":%lu}", i > 0 ? "," : "",
+				 entry->name, entry->count, (unsigned long long)entry->total, (unsigned long long)entry->min,
+				 (unsigned long long)entry->max, (unsigned long long)p50, (unsigned long long)p99,
+				 (unsigned long long)( entry->queueWait / entry->count ),
+				 (unsigned long long)( entry->submitWait / entry->count ), (unsigned long)entry->bytes );
+		}
+		else {
+			fprintf( out, "%-24s %8lu %12.3f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %14lu\n", entry->name, entry->count,
+				 entry->total * 1e-6, entry->min * 1e-3, entry->max * 1e-3, p50 * 1e-3, p99 * 1e-3,
+				 (double)( entry->queueWait / entry->count ) * 1e-3,
+				 (double)( entry->submitWait / entry->count ) * 1e-3, (unsigned long)entry->bytes );
+		}
+	}
+	if ( json ) {
+		fprintf( out, "\n],\"lost\":%lu}\n", _sclProfileLost );
+	}
+	else if ( _sclProfileLost > 0 ) {
+		fprintf( out, "%lu commands without profiling information\n", _sclProfileLost );
+	}
+	pthread_mutex_unlock( &_sclProfileMutex );
+}
+
+cl_event sclLaunchKernel( sclHard hardware, sclSoft software, size_t *global_work_size, size_t *local_work_size) {
+	return sclLaunchKernelND( hardware, software, 2, NULL, global_work_size, local_work_size );
+}
+
+cl_event sclEnqueueKernel( sclHard hardware, sclSoft software, size_t *global_work_size, size_t *local_work_size) {
+	return sclEnqueueKernelND( hardware, software, 2, NULL, global_work_size, local_work_size );
+}
+
+void sclReleaseClSoft( sclSoft soft ) {
+	clReleaseKernel( soft.kernel );
+	if ( !_sclReleaseRegisteredProgram( soft.program ) ) {
+		clReleaseProgram( soft.program );
+	}
+}
+
+/* Extra queue sets of the devices, see sclCreateQueues */
+static int* _sclNextQueueIndex = NULL;
+static int _sclNextQueueLength = 0;
+static int* _sclQueueRefs = NULL;
+static int _sclQueueRefsLength = 0;
+static pthread_mutex_t _sclQueuesMutex = PTHREAD_MUTEX_INITIALIZER;
+
+void sclReleaseClHard( sclHard hardware ){
+	cl_command_queue primary = hardware.queue;
+
+	if ( hardware.context == NULL ) {
+		return;
+	}
+	/* A copy from sclSelectQueue or sclNextQueue uses an extra queue */
+	if ( _sclIsListed( &hardware ) && _sclHardList[ hardware.devNum ].queue != NULL ) {
+		primary = _sclHardList[ hardware.devNum ].queue;
+	}
+	/* The extra queues hold a reference to the context */
+	if ( hardware.queues != NULL ) {
+		sclReleaseQueues( &hardware );
+	}
+	_sclPoolDropQueue( primary );
+	_sclHostDropQueue( primary );
+	clReleaseCommandQueue( primary );
+	clReleaseContext( hardware.context );
+}
+
+void sclRetainClHard( sclHard hardware ) {
+	cl_command_queue primary = hardware.queue;
+
+	if ( hardware.context == NULL ) {
+		return;
+	}
+	if ( _sclIsListed( &hardware ) && _sclHardList[ hardware.devNum ].queue != NULL ) {
+		primary = _sclHardList[ hardware.devNum ].queue;
+	}
+	pthread_mutex_lock( &_sclQueuesMutex );
+	if ( hardware.queues != NULL && _sclIsListed( &hardware ) &&
+			_sclHardList[ hardware.devNum ].queues == hardware.queues ) {
+		( *_sclQueueRefCount( hardware.devNum ) )++;
+	}
+	pthread_mutex_unlock( &_sclQueuesMutex );
+	clRetainCommandQueue( primary );
+	clRetainContext( hardware.context );
+}
+
+void sclReleaseAllHardware ( sclHard* hardList, int found ) {
+	int i;	
+
+	for ( i = 0; i < found; ++i ) {
+		sclReleaseClHard( hardList[i] );
+	}
+ 
+}
+
+void sclRetainAllHardware ( sclHard* hardList, int found ) {
+	int i;	
+
+	for ( i = 0; i < found; ++i ) {
+		sclRetainClHard( hardList[i] );
+	}
+ 
+}
+
+void sclReleaseMemObject( cl_mem object ) {
+	cl_int err;
+
+	if ( _sclPoolRelease( object ) ) {
+		return;
+	}
+
+	err = clReleaseMemObject( object );
+	if ( err != CL_SUCCESS ) {
+		fprintf( stderr,  "\nError on sclReleaseMemObject" );
+		sclPrintErrorFlags(err); 
+	}	
+
+}
+
+void sclPrintDeviceNamePlatforms( sclHard* hardList, int found ) {
+	int i;
+	cl_char deviceName[1024];
+	cl_char platformVendor[1024];
+	cl_char platformName[1024];
+
+	for ( i = 0; i < found; ++i ) {
+		clGetPlatformInfo( hardList[i].platform, CL_PLATFORM_NAME, sizeof(cl_char)*1024, platformName, NULL );	
+		clGetPlatformInfo( hardList[i].platform, CL_PLATFORM_VENDOR, sizeof(cl_char)*1024, platformVendor, NULL );
+		clGetDeviceInfo( hardList[i].device, CL_DEVICE_NAME, sizeof(cl_char)*1024, deviceName, NULL );
+		fprintf( stdout, "\n Device %d \n Platform name: %s \n Vendor: %s \n Device name: %s", 
+				hardList[i].devNum, platformName, platformVendor, deviceName );	
+	}
+
+}
+
+void sclPrintHardwareStatus( sclHard hardware ) {
+
+	cl_int err;
+	char platform[100];
+	cl_bool deviceAV;
+
+	err = clGetPlatformInfo( hardware.platform,
+			CL_PLATFORM_NAME,
+			sizeof(char)*100,
+			platform,
+			NULL );
+	if ( err == CL_SUCCESS ) { fprintf( stdout, "\nPlatform object alive" ); }
+	else { sclPrintErrorFlags( err ); }
+	
+	err = clGetDeviceInfo( hardware.device,
+			CL_DEVICE_AVAILABLE,
+			sizeof(cl_bool),
+			(void*)(&deviceAV),
+			NULL );
+	if ( err == CL_SUCCESS && deviceAV ) {
+		fprintf( stdout, "\nDevice object alive and device available." );
+	}
+	else if ( err == CL_SUCCESS ) {
+		fprintf( stdout, "\nDevice object alive and device NOT available.");
+	}
+	else {
+		fprintf( stderr, "\nDevice object not alive.");
+	} 
+
+}
+
+void _sclCreateQueues( sclHard* hardList, int found ) {
+
+	int i;
+#ifdef DEBUG
+	cl_int err;
+
+	for ( i = 0; i < found; ++i ) {
+		hardList[i].queue = clCreateCommandQueue( hardList[i].context, hardList[i].device,
+							 CL_QUEUE_PROFILING_ENABLE, &err );
+		if ( err != CL_SUCCESS ) {
+			fprintf( stderr, "\nError creating command queue %d", i );
+		}
+	}
+#else
+	for ( i = 0; i < found; ++i ) {
+		hardList[i].queue = 
+		clCreateCommandQueue( hardList[i].context, hardList[i].device,
+				      _sclProfilerEnabled() ? CL_QUEUE_PROFILING_ENABLE : 0, NULL );
+	}
+#endif
+
+}
+
+/* Extra queues of a device. Work sent to different queues may overlap, and on
+   out-of-order queues commands only wait for the events they are given. The
+   default queue (hardware.queue) is not part of the set. The hardware list owns
+   the set of every listed device, the copies only point to it. It is counted
+   like the context: sclCreateQueues and sclRetainClHard add a reference,
+   sclReleaseQueues and sclReleaseClHard drop one. */
+
+int _sclIsListed( sclHard* hardware ) {
+	return hardware->devNum >= 0 && hardware->devNum < _sclHardListLength &&
+		_sclHardList[ hardware->devNum ].device == hardware->device;
+}
+
+/* The caller holds _sclQueuesMutex */
+int* _sclQueueRefCount( int devNum ) {
+	int i;
+
+	if ( devNum >= _sclQueueRefsLength ) {
+		_sclQueueRefs = (int*)realloc( _sclQueueRefs, ( devNum + 1 ) * sizeof(int) );
+		for ( i = _sclQueueRefsLength; i <= devNum; ++i ) {
+			_sclQueueRefs[i] = 0;
+		}
+		_sclQueueRefsLength = devNum + 1;
+	}
+
+	return &_sclQueueRefs[ devNum ];
+}
+
+void _sclFreeQueues( cl_command_queue* queues, int nQueues ) {
+	int i;
+
+	for ( i = 0; i < nQueues; ++i ) {
+		clFinish( queues[i] );
+		_sclPoolDropQueue( queues[i] );
+		_sclHostDropQueue( queues[i] );
+		clReleaseCommandQueue( queues[i] );
+	}
+	free( queues );
+}
+
+int sclCreateQueues( sclHard* hardware, int nQueues, int outOfOrder ) {
+	cl_command_queue_properties supported = 0, properties = CL_QUEUE_PROFILING_ENABLE;
+	cl_command_queue* queues = NULL;
+	cl_command_queue* old;
+	cl_int err;
+	int i, created = 0, nOld;
+
+	if ( outOfOrder ) {
+		clGetDeviceInfo( hardware->device, CL_DEVICE_QUEUE_PROPERTIES, sizeof(supported), &supported, NULL );
+		if ( supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE ) {
+			properties |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+		}
+	}
+
+	/* The new set is made before the old one is freed, so stale copies never
+	   point to an array at the same address */
+	if ( nQueues > 0 ) {
+		queues = (cl_command_queue*)malloc( nQueues * sizeof(cl_command_queue) );
+	}
+	for ( i = 0; i < nQueues; ++i ) {
+		queues[ created ] = clCreateCommandQueue( hardware->context, hardware->device, properties, &err );
+		if ( err != CL_SUCCESS ) {
+			fprintf( stderr, "\nError creating command queue %d of device %d", i, hardware->devNum );
+			sclPrintErrorFlags( err );
+			continue;
+		}
+		created++;
+	}
+	if ( created == 0 ) {
+		free( queues );
+		queues = NULL;
+	}
+
+	/* The set of a listed device is replaced for all its copies, and copies
+	   of the hardware list taken later get the new queues too */
+	pthread_mutex_lock( &_sclQueuesMutex );
+	if ( _sclIsListed( hardware ) ) {
+		old  = _sclHardList[ hardware->devNum ].queues;
+		nOld = _sclHardList[ hardware->devNum ].nQueues;
+		_sclHardList[ hardware->devNum ].queues  = queues;
+		_sclHardList[ hardware->devNum ].nQueues = created;
+		*_sclQueueRefCount( hardware->devNum ) = created > 0 ? 1 : 0;
+	}
+	else {
+		old  = hardware->queues;
+		nOld = hardware->nQueues;
+	}
+	pthread_mutex_unlock( &_sclQueuesMutex );
+	if ( old != NULL ) {
+		_sclFreeQueues( old, nOld );
+	}
+	hardware->queues  = queues;
+	hardware->nQueues = created;
+
+	return created;
+}
+
+sclHard sclSelectQueue( sclHard hardware, int index ) {
+	if ( hardware.nQueues <= 0 || index < 0 ) {
+		return hardware;
+	}
+	/* A copy whose set was replaced or released keeps its queue */
+	pthread_mutex_lock( &_sclQueuesMutex );
+	if ( !_sclIsListed( &hardware ) || _sclHardList[ hardware.devNum ].queues == hardware.queues ) {
+		hardware.queue = hardware.queues[ index % hardware.nQueues ];
+	}
+	pthread_mutex_unlock( &_sclQueuesMutex );
+
+	return hardware;
+}
+
+sclHard sclNextQueue( sclHard hardware ) {
+	int i, index;
+
+	if ( hardware.nQueues == 0 || hardware.devNum < 0 ) {
+		return hardware;
+	}
+	pthread_mutex_lock( &_sclQueuesMutex );
+	if ( hardware.devNum >= _sclNextQueueLength ) {
+		_sclNextQueueIndex = (int*)realloc( _sclNextQueueIndex, ( hardware.devNum + 1 ) * sizeof(int) );
+		for ( i = _sclNextQueueLength; i <= hardware.devNum; ++i ) {
+			_sclNextQueueIndex[i] = 0;
+		}
+		_sclNextQueueLength = hardware.devNum + 1;
+	}
+	index = _sclNextQueueIndex[ hardware.devNum ]++ % hardware.nQueues;
+	pthread_mutex_unlock( &_sclQueuesMutex );
+
+	return sclSelectQueue( hardware, index );
+}
+
+void sclReleaseQueues( sclHard* hardware ) {
+	cl_command_queue* queues = NULL;
+	int nQueues = 0;
+
+	/* A copy of a listed device only frees the set with its last reference,
+	   a copy whose set was already replaced or released frees nothing */
+	pthread_mutex_lock( &_sclQueuesMutex );
+	if ( _sclIsListed( hardware ) ) {
+		if ( hardware->queues != NULL && _sclHardList[ hardware->devNum ].queues == hardware->queues &&
+				--( *_sclQueueRefCount( hardware->devNum ) ) <= 0 ) {
+			queues  = _sclHardList[ hardware->devNum ].queues;
+			nQueues = _sclHardList[ hardware->devNum ].nQueues;
+			_sclHardList[ hardware->devNum ].queues  = NULL;
+			_sclHardList[ hardware->devNum ].nQueues = 0;
+		}
+	}
+	else {
+		queues  = hardware->queues;
+		nQueues = hardware->nQueues;
+	}
+	pthread_mutex_unlock( &_sclQueuesMutex );
+	if ( queues != NULL ) {
+		_sclFreeQueues( queues, nQueues );
+	}
+	hardware->queues  = NULL;
+	hardware->nQueues = 0;
+}
+
+void _sclSmartCreateContexts( sclHard* hardList, int found ) {
+
+	cl_device_id* deviceList;
+	cl_context context;
+	char var_queries1[1024];
+	char var_queries2[1024];
+#ifdef DEBUG
+	cl_int err;
+#endif
+	int* groupOf;
+	int* groupSizes;
+	int i, j, k, groupSet = 0;
+	int nGroups = 0;
+
+	if ( found <= 0 ) {
+		return;
+	}
+
+	/* There are never more groups than devices, nor devices in a group */
+	deviceList = (cl_device_id*)malloc( found * sizeof(cl_device_id) );
+	groupOf    = (int*)malloc( found * sizeof(int) );
+	groupSizes = (int*)calloc( found, sizeof(int) );
+
+	for ( i = 0; i < found; ++i ) { /* Group generation */
+	
+		clGetPlatformInfo( hardList[i].platform, CL_PLATFORM_NAME, 1024, var_queries1, NULL );
+
+		groupSet=0;
+		for ( j = 0; j < i && !groupSet; ++j ) {
+			/* Compare with the first device of every group */
+			if ( groupOf[j] != j ) {
+				continue;
+			}
+			clGetPlatformInfo( hardList[j].platform, CL_PLATFORM_NAME, 1024, var_queries2, NULL );
+			if ( strcmp( var_queries1, var_queries2 ) == 0 &&
+					hardList[i].deviceType == hardList[j].deviceType &&
+					hardList[i].maxPointerSize == hardList[j].maxPointerSize ) {
+				groupOf[i] = j;
+				groupSizes[j]++;
+				groupSet = 1;	
+			}
+		}
+		if ( !groupSet ) {
+			groupOf[i] = i;
+			groupSizes[i] = 1;
+			nGroups++;
+		}
+	}
+
+	for ( i = 0, k = 0; i < found; ++i ) { /* Context generation */
+		if ( groupOf[i] != i ) {
+			continue;
+		}
+	
+		fprintf( stdout, "\nGroup %d with %d devices", ++k, groupSizes[i] );	
+		for ( j = i, groupSet = 0; j < found; ++j ) {
+			if ( groupOf[j] == i ) {
+				deviceList[ groupSet++ ] = hardList[j].device;
+			}
+		}
+#ifdef DEBUG
+		context = clCreateContext( 0, groupSizes[i], deviceList, NULL, NULL, &err );
+		if ( err != CL_SUCCESS ) {
+			fprintf( stderr, "\nError creating context on device %d", i );
+		}
+#else
+		context = clCreateContext( 0, groupSizes[i], deviceList, NULL, NULL, NULL );
+#endif
+		for ( j = i; j < found; ++j ) {
+			if ( groupOf[j] == i ) {
+				hardList[j].context = context;
+			}
+		}
+	}
+
+	free( deviceList );
+	free( groupOf );
+	free( groupSizes );
+}
+
+int _sclGetMaxComputeUnits( cl_device_id device ) {
+	
+	cl_uint nCompU;
+
+	clGetDeviceInfo( device, CL_DEVICE_MAX_COMPUTE_UNITS, 4, (void *)&nCompU, NULL );
+
+	return (int)nCompU;	
+
+}
+
+unsigned long int _sclGetMaxMemAllocSize( cl_device_id device ){
+
+	cl_ulong mem;
+
+ 	clGetDeviceInfo( device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, 8, (void *)&mem, NULL );
+
+	return (unsigned long int)mem;	
+
+}
+
+cl_device_type _sclGetDeviceType( cl_device_id device ) {
+	cl_device_type dev_type;
+
+	clGetDeviceInfo(device,CL_DEVICE_TYPE,sizeof(dev_type),&dev_type,NULL);
+	
+	return dev_type;
+}
+
+int _sclGetHostUnifiedMemory( cl_device_id device ) {
+	cl_bool unified = CL_FALSE;
+
+	if ( clGetDeviceInfo( device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified), &unified, NULL ) != CL_SUCCESS ) {
+		/* Not reported, CPU devices always share the host memory */
+		return _sclGetDeviceType( device ) == CL_DEVICE_TYPE_CPU;
+	}
+
+	return unified == CL_TRUE;
+}
+
+sclHard sclGetFastestDevice( sclHard* hardList, int found ) {
+	int i, maxCpUnits = 0, device = 0;
+
+	for ( i = 0; i < found ; ++i ) {
+		fprintf( stdout, "\nDevice %d Compute Units %d", i, hardList[i].nComputeUnits );
+		if ( maxCpUnits < hardList[i].nComputeUnits ) {
+			device = i;
+			maxCpUnits = hardList[i].nComputeUnits;
+		}
+	}
+
+	return hardList[ device ];
+}
+
+/* Device discovery. Platform and device IDs are cheap to get, the properties of
+   every device are queried in parallel, one thread per device, and no context
+   or queue is created. Contexts and queues are created when a device is
+   selected (sclOpenHardware, sclGetGPUHardware, sclGetCPUHardware) or for all
+   devices by sclGetAllHardware. The properties can be kept in an inventory
+   file, given by SCL_INVENTORY or sclSetInventoryFile, so warm starts skip most
+   of the clGetDeviceInfo calls. An entry is used only if the platform name,
+   version and number of devices, and the device name and driver version, did
+   not change. Name and driver are always queried, one thread per device. */
+
+static char _sclInventoryFile[1024];
+static int _sclInventoryInit = 0;
+
+void sclSetInventoryFile( const char* filename ) {
+	_sclInventoryInit = 1;
+	snprintf( _sclInventoryFile, sizeof(_sclInventoryFile), "%s", filename != NULL ? filename : "" );
+}
+
+const char* _sclGetInventoryFile( void ) {
+	const char* env;
+
+	if ( !_sclInventoryInit ) {
+		_sclInventoryInit = 1;
+		_sclInventoryFile[0] = '\0';
+		if ( ( env = getenv( "SCL_INVENTORY" ) ) != NULL ) {
+			snprintf( _sclInventoryFile, sizeof(_sclInventoryFile), "%s", env );
+		}
+	}
+
+	return _sclInventoryFile[0] != '\0' ? _sclInventoryFile : NULL;
+}
+
+cl_ulong _sclGetPlatformHash( cl_platform_id platform ) {
+	char name[1024];
+	char version[256];
+
+	name[0] = '\0';
+	version[0] = '\0';
+	clGetPlatformInfo( platform, CL_PLATFORM_NAME, sizeof(name), name, NULL );
+	clGetPlatformInfo( platform, CL_PLATFORM_VERSION, sizeof(version), version, NULL );
+
+	return _sclHashString( _sclHashString( 14695981039346656037ULL, name ), version );
+}
+
+void* _sclQueryDevice( void* arg ) {
+	sclHard* hardware = (sclHard*)arg;
+
+	hardware->nComputeUnits  = _sclGetMaxComputeUnits( hardware->device );
+	hardware->maxPointerSize = _sclGetMaxMemAllocSize( hardware->device );
+	hardware->deviceType     = _sclGetDeviceType( hardware->device );
+	hardware->unifiedMemory  = _sclGetHostUnifiedMemory( hardware->device );
+
+	return NULL;
+}
+
+typedef struct {
+	cl_device_id device;
+	cl_ulong hash;
+} _sclDeviceHashJob;
+
+void* _sclHashDevice( void* arg ) {
+	_sclDeviceHashJob* job = (_sclDeviceHashJob*)arg;
+
+	job->hash = _sclGetDeviceHash( job->device );
+
+	return NULL;
+}
+
+/* Fills the properties of the devices with an inventory line that still
+   matches, returns 1 if all of them were found */
+int _sclLoadInventory( sclHard* hardList, int found, const int* platformIndex, const int* deviceIndex,
+		       const cl_ulong* platformHash, const int* platformDevices, const cl_ulong* deviceHash ) {
+	const char* filename = _sclGetInventoryFile();
+	unsigned long long hash, device;
+	unsigned long type, maxAlloc;
+	int p, d, nDevices, units, unified, i, loaded = 0;
+	FILE* in;
+
+	if ( filename == NULL || ( in = fopen( filename, "r" ) ) == NULL ) {
+		return 0;
+	}
+	while ( fscanf( in, "%d %d %llx %d %llx %lx %d %lu %d", &p, &d, &hash, &nDevices, &device,
+			&type, &units, &maxAlloc, &unified ) == 9 ) {
+		/* The device at an index may change with the same platform, e.g. a swapped GPU */
+		for ( i = 0; i < found; ++i ) {
+			if ( platformIndex[i] == p && deviceIndex[i] == d && platformHash[i] == (cl_ulong)hash &&
+					platformDevices[i] == nDevices && deviceHash[i] == (cl_ulong)device &&
+					hardList[i].nComputeUnits < 0 ) {
+				hardList[i].deviceType     = (cl_device_type)type;
+				hardList[i].nComputeUnits  = units;
+				hardList[i].maxPointerSize = maxAlloc;
+				hardList[i].unifiedMemory  = unified;
+				loaded++;
+			}
+		}
+	}
+	fclose( in );
+
+	return loaded == found;
+}
+
+void _sclStoreInventory( sclHard* hardList, int found, const int* platformIndex, const int* deviceIndex,
+			 const cl_ulong* platformHash, const int* platformDevices, const cl_ulong* deviceHash ) {
+	const char* filename = _sclGetInventoryFile();
+	FILE* out;
+	int i;
+
+	if ( filename == NULL || ( out = fopen( filename, "w" ) ) == NULL ) {
+		return;
+	}
+	for ( i = 0; i < found; ++i ) {
+		fprintf( out, "%d %d %llx %d %llx %lx %d %lu %d\n", platformIndex[i], deviceIndex[i],
+			 (unsigned long long)platformHash[i], platformDevices[i], (unsigned long long)deviceHash[i],
+			 (unsigned long)hardList[i].deviceType,
+			 hardList[i].nComputeUnits, hardList[i].maxPointerSize, hardList[i].unifiedMemory );
+	}
+	fclose( out );
+}
+
+void _sclDiscoverDevices( void ) {
+	cl_platform_id* platforms;
+	cl_device_id* devices;
+	cl_uint nPlatforms = 0, nDevices = 0, total = 0;
+	cl_ulong hash, *platformHash, *deviceHash;
+	int *platformIndex, *deviceIndex, *platformDevices, *started;
+	_sclDeviceHashJob* jobs;
+	pthread_t* threads;
+	int i, j, found = 0;
+	cl_int err;
+
+	if ( _sclHardList != NULL ) {
+		return;
+	}
+	_sclHardListLength = 0;
+
+	clGetPlatformIDs( 0, NULL, &nPlatforms );
+	if ( nPlatforms == 0 ) {
+		fprintf( stderr, "\nNo OpenCL platforms found.\n");
+		_sclHardList = (sclHard*)malloc( sizeof(sclHard) );
+		return;
+	}
+	platforms = (cl_platform_id*)malloc( nPlatforms * sizeof(cl_platform_id) );
+	clGetPlatformIDs( nPlatforms, platforms, &nPlatforms );
+
+	/* Count every device first, so all the lists have their exact size */
+	for ( i = 0; i < (int)nPlatforms; ++i ) {
+		nDevices = 0;
+		clGetDeviceIDs( platforms[i], CL_DEVICE_TYPE_ALL, 0, NULL, &nDevices );
+		total += nDevices;
+	}
+	_sclHardList    = (sclHard*)malloc( ( total + 1 ) * sizeof(sclHard) );
+	devices         = (cl_device_id*)malloc( ( total + 1 ) * sizeof(cl_device_id) );
+	platformHash    = (cl_ulong*)calloc( total + 1, sizeof(cl_ulong) );
+	deviceHash      = (cl_ulong*)calloc( total + 1, sizeof(cl_ulong) );
+	platformIndex   = (int*)calloc( total + 1, sizeof(int) );
+	deviceIndex     = (int*)calloc( total + 1, sizeof(int) );
+	platformDevices = (int*)calloc( total + 1, sizeof(int) );
+	started         = (int*)calloc( total + 1, sizeof(int) );
+	threads         = (pthread_t*)malloc( ( total + 1 ) * sizeof(pthread_t) );
+
+	for ( i = 0; i < (int)nPlatforms && found < (int)total; ++i ) {
+		nDevices = 0;
+		err = clGetDeviceIDs( platforms[i], CL_DEVICE_TYPE_ALL, total - found, devices, &nDevices );
+		if ( nDevices == 0 ) {
+			fprintf( stderr, "\nNo OpenCL enabled device found.");
+			if ( err != CL_SUCCESS ) {
+				fprintf( stderr,  "\nError clGetDeviceIDs" );
+				sclPrintErrorFlags( err );
+			}
+			continue;
+		}
+		if ( nDevices > total - found ) {
+			nDevices = total - found;
+		}
+		hash = _sclGetInventoryFile() != NULL ? _sclGetPlatformHash( platforms[i] ) : 0;
+		for ( j = 0; j < (int)nDevices; ++j ) {
+			_sclHardList[ found ].platform       = platforms[ i ];
+			_sclHardList[ found ].device         = devices[ j ];
+			_sclHardList[ found ].context        = NULL;
+			_sclHardList[ found ].queue          = NULL;
+			_sclHardList[ found ].nComputeUnits  = -1;
+			_sclHardList[ found ].devNum         = found;
+			_sclHardList[ found ].queues         = NULL;
+			_sclHardList[ found ].nQueues        = 0;
+			platformIndex[ found ]   = i;
+			deviceIndex[ found ]     = j;
+			platformHash[ found ]    = hash;
+			platformDevices[ found ] = (int)nDevices;
+			found++;
+		}
+	}
+
+	/* Inventory lines are checked against the name and driver of every device */
+	if ( _sclGetInventoryFile() != NULL ) {
+		jobs = (_sclDeviceHashJob*)calloc( found + 1, sizeof(_sclDeviceHashJob) );
+		for ( i = 0; i < found; ++i ) {
+			jobs[i].device = _sclHardList[i].device;
+			started[i] = pthread_create( &threads[i], NULL, _sclHashDevice, &jobs[i] ) == 0;
+			if ( !started[i] ) {
+				_sclHashDevice( &jobs[i] );
+			}
+		}
+		for ( i = 0; i < found; ++i ) {
+			if ( started[i] ) {
+				pthread_join( threads[i], NULL );
+			}
+			deviceHash[i] = jobs[i].hash;
+		}
+		free( jobs );
+	}
+
+	/* Warm start from the inventory, or query every device in its own thread */
+	if ( !_sclLoadInventory( _sclHardList, found, platformIndex, deviceIndex, platformHash, platformDevices, deviceHash ) ) {
+		for ( i = 0; i < found; ++i ) {
+			started[i] = 0;
+			if ( _sclHardList[i].nComputeUnits < 0 ) {
+				started[i] = pthread_create( &threads[i], NULL, _sclQueryDevice, &_sclHardList[i] ) == 0;
+				if ( !started[i] ) {
+					_sclQueryDevice( &_sclHardList[i] );
+				}
+			}
+		}
+		for ( i = 0; i < found; ++i ) {
+			if ( started[i] ) {
+				pthread_join( threads[i], NULL );
+			}
+		}
+		_sclStoreInventory( _sclHardList, found, platformIndex, deviceIndex, platformHash, platformDevices, deviceHash );
+	}
+
+	_sclHardListLength = found;
+
+	free( platforms );
+	free( devices );
+	free( platformHash );
+	free( deviceHash );
+	free( platformIndex );
+	free( deviceIndex );
+	free( platformDevices );
+	free( started );
+	free( threads );
+}
+
+sclHard* sclDiscoverHardware( int* found ) {
+	_sclDiscoverDevices();
+	*found = _sclHardListLength;
+
+	return _sclHardList;
+}
+
+int sclOpenHardware( sclHard* hardware ) {
+	cl_int err;
+
+	if ( hardware->context == NULL ) {
+		hardware->context = clCreateContext( 0, 1, &hardware->device, NULL, NULL, &err );
+		if ( err != CL_SUCCESS ) {
+			fprintf( stderr, "\nError creating context on device %d", hardware->devNum );
+			sclPrintErrorFlags( err );
+			hardware->context = NULL;
+			return 0;
+		}
+		_sclCreateQueues( hardware, 1 );
+		sclRetainClHard( *hardware );
+	}
+
+	/* Keep the library list up to date for the next selections */
+	if ( hardware->devNum >= 0 && hardware->devNum < _sclHardListLength &&
+			_sclHardList[ hardware->devNum ].device == hardware->device ) {
+		_sclHardList[ hardware->devNum ].context = hardware->context;
+		_sclHardList[ hardware->devNum ].queue   = hardware->queue;
+	}
+
+	return 1;
+}
+
+sclHard* sclGetAllHardware( int* found ) {
+	sclHard* closed;
+	int i, nClosed = 0;
+
+	_sclDiscoverDevices();
+	*found = _sclHardListLength;
+
+	/* Contexts and queues for the devices that were not selected before */
+	closed = (sclHard*)malloc( ( _sclHardListLength + 1 ) * sizeof(sclHard) );
+	for ( i = 0; i < _sclHardListLength; ++i ) {
+		if ( _sclHardList[i].context == NULL ) {
+			closed[ nClosed++ ] = _sclHardList[i];
+		}
+	}
+	if ( nClosed > 0 ) {
+		_sclSmartCreateContexts( closed, nClosed );
+		_sclCreateQueues( closed, nClosed );
+		sclRetainAllHardware( closed, nClosed );
+		for ( i = 0; i < nClosed; ++i ) {
+			_sclHardList[ closed[i].devNum ].context = closed[i].context;
+			_sclHardList[ closed[i].devNum ].queue   = closed[i].queue;
+		}
+	}
+	free( closed );
+#ifdef DEBUG
+	sclPrintDeviceNamePlatforms( _sclHardList, *found );
+#endif
+	
+	return _sclHardList;
+
+}
+
+/* Measured device selection. Every device runs two short calibration kernels,
+   a compute bound one (GFLOP/s) and a bandwidth bound one (GB/s). The scores
+   are kept per device name and driver version, in memory and in scl_scores.txt
+   in the binary cache directory, so the calibration runs once. */
+
+static const char* _sclCalibrationSource =
+	"__kernel void scl_calib_flops( __global float4* out, float a, float b ) {\n"
+	"	float4 x = (float4)( get_global_id(0) ), y = x + 1.0f;\n"
+	"	int i;\n"
+	"	for ( i = 0; i < 128; ++i ) {\n"
+	"		x = mad( x, a, b ); y = mad( y, a, b );\n"
+	"		x = mad( x, a, b ); y = mad( y, a, b );\n"
+	"	}\n"
+	"	out[ get_global_id(0) ] = x + y;\n"
+	"}\n"
+	"__kernel void scl_calib_bandwidth( __global const float4* in, __global float4* out ) {\n"
+	"	out[ get_global_id(0) ] = in[ get_global_id(0) ];\n"
+	"}\n";
+
+/* 128 iterations of 4 float4 mad, 2 flops each */
+#define _SCL_CALIB_FLOPS_PER_ITEM ( 128.0 * 4.0 * 4.0 * 2.0 )
+
+typedef struct {
+	cl_ulong device;
+	double score[2];
+} _sclScoreEntry;
+
+static _sclScoreEntry* _sclScoreList = NULL;
+static int _sclScoreListLength = 0;
+static int _sclScoresLoaded = 0;
+
+void _sclLoadScores( void ) {
+	const char* dir = _sclGetBinaryCacheDir();
+	char filename[1100];
+	unsigned long long device;
+	_sclScoreEntry entry;
+	FILE* in;
+
+	_sclScoresLoaded = 1;
+	if ( dir == NULL ) {
+		return;
+	}
+	snprintf( filename, sizeof(filename), "%s/scl_scores.txt", dir );
+	if ( ( in = fopen( filename, "r" ) ) == NULL ) {
+		return;
+	}
+	while ( fscanf( in, "%llx %lf %lf", &device, &entry.score[ SCL_SCORE_FLOPS ], &entry.score[ SCL_SCORE_BANDWIDTH ] ) == 3 ) {
+		entry.device = (cl_ulong)device;
+		_sclScoreList = (_sclScoreEntry*)realloc( _sclScoreList, ( _sclScoreListLength + 1 ) * sizeof(_sclScoreEntry) );
+		_sclScoreList[ _sclScoreListLength++ ] = entry;
+	}
+	fclose( in );
+}
+
+void _sclStoreScore( _sclScoreEntry entry ) {
+	const char* dir = _sclGetBinaryCacheDir();
+	char filename[1100];
+	FILE* out;
+
+	_sclScoreList = (_sclScoreEntry*)realloc( _sclScoreList, ( _sclScoreListLength + 1 ) * sizeof(_sclScoreEntry) );
+	_sclScoreList[ _sclScoreListLength++ ] = entry;
+	if ( dir == NULL ) {
+		return;
+	}
+	mkdir( dir, 0755 );
+	snprintf( filename, sizeof(filename), "%s/scl_scores.txt", dir );
+	if ( ( out = fopen( filename, "a" ) ) != NULL ) {
+		fprintf( out, "%llx %g %g\n", (unsigned long long)entry.device,
+			 entry.score[ SCL_SCORE_FLOPS ], entry.score[ SCL_SCORE_BANDWIDTH ] );
+		fclose( out );
+	}
+}
+
+/* Runs both calibration kernels, the scores are 0 if they could not run */
+_sclScoreEntry _sclCalibrateDevice( sclHard hardware ) {
+	_sclScoreEntry entry;
+	sclSoft flops, bandwidth;
+	cl_program program;
+	cl_mem in, out;
+	cl_float a = 0.999f, b = 0.001f;
+	size_t global, bytes;
+	double ns;
+
+	entry.device = _sclGetDeviceHash( hardware.device );
+	entry.score[ SCL_SCORE_FLOPS ] = 0.0;
+	entry.score[ SCL_SCORE_BANDWIDTH ] = 0.0;
+
+	program = _sclGetCachedProgram( _sclCalibrationSource, "", hardware, "calibration" );
+	if ( program == NULL ) {
+		return entry;
+	}
+	flops.program = program;
+	bandwidth.program = program;
+	sprintf( flops.kernelName, "scl_calib_flops" );
+	sprintf( bandwidth.kernelName, "scl_calib_bandwidth" );
+	flops.kernel = _sclCreateKernel( flops );
+	bandwidth.kernel = _sclCreateKernel( bandwidth );
+
+	/* Enough work-items to fill every compute unit */
+	global = (size_t)( hardware.nComputeUnits > 0 ? hardware.nComputeUnits : 1 ) * 4096;
+	out = sclMalloc( hardware, CL_MEM_WRITE_ONLY, global * 4 * sizeof(cl_float) );
+	if ( flops.kernel != NULL && out != NULL ) {
+		sclSetKernelArgs( flops, "%v%a%a", &out, sizeof(cl_float), &a, sizeof(cl_float), &b );
+		ns = _sclTimeLocalSize( hardware, flops, 1, NULL, &global, NULL, 0, NULL );
+		if ( ns > 0.0 ) {
+			entry.score[ SCL_SCORE_FLOPS ] = global * _SCL_CALIB_FLOPS_PER_ITEM / ns;
+		}
+	}
+	sclReleaseMemObject( out );
+
+	/* 64 MB copied, less if the device can not allocate it */
+	bytes = (size_t)64 << 20;
+	if ( hardware.maxPointerSize > 0 && bytes > hardware.maxPointerSize / 2 ) {
+		bytes = hardware.maxPointerSize / 2;
+	}
+	global = bytes / ( 4 * sizeof(cl_float) );
+	in  = sclMalloc( hardware, CL_MEM_READ_ONLY, bytes );
+	out = sclMalloc( hardware, CL_MEM_WRITE_ONLY, bytes );
+	if ( bandwidth.kernel != NULL && in != NULL && out != NULL && global > 0 ) {
+		sclSetKernelArgs( bandwidth, "%v%v", &in, &out );
+		ns = _sclTimeLocalSize( hardware, bandwidth, 1, NULL, &global, NULL, 0, NULL );
+		if ( ns > 0.0 ) {
+			entry.score[ SCL_SCORE_BANDWIDTH ] = 2.0 * bytes / ns;
+		}
+	}
+	sclReleaseMemObject( in );
+	sclReleaseMemObject( out );
+
+	if ( flops.kernel != NULL ) {
+		clReleaseKernel( flops.kernel );
+	}
+	if ( bandwidth.kernel != NULL ) {
+		clReleaseKernel( bandwidth.kernel );
+	}
+	clReleaseProgram( program );
+
+	return entry;
+}
+
+double sclGetDeviceScore( sclHard* hardware, int metric ) {
+	_sclScoreEntry entry;
+	cl_ulong device;
+	int i;
+
+	if ( metric != SCL_SCORE_FLOPS && metric != SCL_SCORE_BANDWIDTH ) {
+		return 0.0;
+	}
+	if ( !_sclScoresLoaded ) {
+		_sclLoadScores();
+	}
+	device = _sclGetDeviceHash( hardware->device );
+	for ( i = 0; i < _sclScoreListLength; ++i ) {
+		if ( _sclScoreList[i].device == device ) {
+			return _sclScoreList[i].score[ metric ];
+		}
+	}
+
+	if ( !sclOpenHardware( hardware ) ) {
+		return 0.0;
+	}
+	entry = _sclCalibrateDevice( *hardware );
+	_sclStoreScore( entry );
+
+	return entry.score[ metric ];
+}
+
+sclHard sclGetBestDevice( sclHard* hardList, int found, int metric ) {
+	double score, bestScore = -1.0;
+	int i, device = 0;
+
+	for ( i = 0; i < found; ++i ) {
+		score = sclGetDeviceScore( &hardList[i], metric );
+		fprintf( stdout, "\nDevice %d score %g", i, score );
+		if ( score > bestScore ) {
+			device = i;
+			bestScore = score;
+		}
+	}
+	sclOpenHardware( &hardList[ device ] );
+
+	return hardList[ device ];
+}
+
+/* One launch of parsed managed arguments, in seconds. It takes the path of
+   sclManageArgsLaunchKernel, but %w and %R results go to scratch copies, so
+   the host arrays of the caller are never written. */
+double _sclTimeParsedArgs( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_size,
+			   size_t *local_work_size, _sclArgSpec* args, int nArgs ) {
+	cl_mem *buffers;
+	void **scratch, *mapped;
+	double start, elapsed;
+	int i;
+
+	buffers = (cl_mem*)calloc( nArgs > 0 ? nArgs : 1, sizeof(cl_mem) );
+	scratch = (void**)calloc( nArgs > 0 ? nArgs : 1, sizeof(void*) );
+	for ( i = 0; i < nArgs; ++i ) {
+		if ( args[i].kind == 'w' || args[i].kind == 'R' ) {
+			scratch[i] = malloc( args[i].size );
+			if ( args[i].kind == 'R' ) {
+				memcpy( scratch[i], args[i].pointer, args[i].size );
+			}
+		}
+	}
+
+	start = _sclGetWallTime();
+	for ( i = 0; i < nArgs; ++i ) {
+		switch ( args[i].kind ) {
+			case 'a':
+				sclSetKernelArg( software, i, args[i].size, args[i].pointer );
+				break;
+			case 'v':
+				sclSetKernelArg( software, i, sizeof(cl_mem), args[i].pointer );
+				break;
+			case 'N':
+				sclSetKernelArg( software, i, args[i].size, NULL );
+				break;
+			case 'r':
+				buffers[i] = hardware.unifiedMemory ?
+					sclMallocHost( hardware, CL_MEM_READ_ONLY, args[i].size, args[i].pointer ) :
+					sclMallocWrite( hardware, CL_MEM_READ_ONLY, args[i].size, args[i].pointer );
+				break;
+			case 'R':
+				buffers[i] = hardware.unifiedMemory ?
+					sclMallocHost( hardware, CL_MEM_READ_WRITE, args[i].size, scratch[i] ) :
+					sclMallocWrite( hardware, CL_MEM_READ_WRITE, args[i].size, scratch[i] );
+				break;
+			case 'w':
+				buffers[i] = hardware.unifiedMemory ?
+					sclMallocHost( hardware, CL_MEM_WRITE_ONLY, args[i].size, NULL ) :
+					sclMalloc( hardware, CL_MEM_WRITE_ONLY, args[i].size );
+				break;
+			case 'g':
+				buffers[i] = sclMalloc( hardware, CL_MEM_READ_WRITE, args[i].size );
+				break;
+			default:
+				break;
+		}
+		if ( buffers[i] != NULL ) {
+			sclSetKernelArg( software, i, sizeof(cl_mem), &buffers[i] );
+		}
+	}
+	sclReleaseEvent( sclLaunchKernelND( hardware, software, work_dim, NULL, global_work_size, local_work_size ) );
+	for ( i = 0; i < nArgs; ++i ) {
+		if ( scratch[i] == NULL || buffers[i] == NULL ) {
+			continue;
+		}
+		if ( hardware.unifiedMemory ) {
+			mapped = sclMap( hardware, buffers[i], CL_MAP_READ, 0, args[i].size );
+			if ( mapped != NULL ) {
+				memcpy( scratch[i], mapped, args[i].size );
+				sclUnmap( hardware, buffers[i], mapped );
+			}
+		}
+		else {
+			sclRead( hardware, args[i].size, buffers[i], scratch[i] );
+		}
+	}
+	elapsed = _sclGetWallTime() - start;
+
+	for ( i = 0; i < nArgs; ++i ) {
+		if ( buffers[i] != NULL ) {
+			sclReleaseMemObject( buffers[i] );
+		}
+		free( scratch[i] );
+	}
+	free( buffers );
+	free( scratch );
+
+	return elapsed;
+}
+
+sclHard sclGetBestDeviceForKernel( sclHard* hardList, int found, int* selected, char* path, char* name, cl_uint work_dim,
+				   size_t *global_work_size, size_t *local_work_size, const char* sizesValues, ... ) {
+	sclSoft software;
+	va_list argList;
+	_sclArgSpec *args;
+	double elapsed, seconds, bestSeconds = -1.0;
+	int i, run, nArgs, device = 0;
+
+	*selected = 0;
+	va_start( argList, sizesValues );
+	nArgs = _sclParseArgs( sizesValues, argList, &args );
+	va_end( argList );
+	if ( nArgs < 0 ) {
+		return hardList[0];
+	}
+
+	for ( i = 0; i < nArgs; ++i ) {
+		if ( args[i].kind == 'o' || args[i].kind == 'n' ) {
+			fprintf( stderr, "\nsclGetBestDeviceForKernel: argument format %%%c is only valid for multi-device launches", args[i].kind );
+			free( args );
+			return hardList[0];
+		}
+	}
+
+	/* The user kernel with its own arguments, best of two launches */
+	for ( i = 0; i < found; ++i ) {
+		if ( !sclOpenHardware( &hardList[i] ) ) {
+			continue;
+		}
+		software = sclGetCLSoftware( path, name, hardList[i] );
+		if ( software.kernel == NULL ) {
+			continue;
+		}
+		seconds = -1.0;
+		for ( run = 0; run < 2; ++run ) {
+			elapsed = _sclTimeParsedArgs( hardList[i], software, work_dim, global_work_size, local_work_size, args, nArgs );
+			if ( seconds < 0.0 || elapsed < seconds ) {
+				seconds = elapsed;
+			}
+		}
+		sclReleaseClSoft( software );
+		fprintf( stdout, "\nDevice %d time %g s", i, seconds );
+		if ( bestSeconds < 0.0 || seconds < bestSeconds ) {
+			device = i;
+			bestSeconds = seconds;
+		}
+		*selected = 1;
+	}
+	free( args );
+
+	return hardList[ device ];
+}
+
+sclHard sclGetGPUHardware( int nDevice, int* found ) {
+	int i;
+	sclHard hardware;
+	cl_int err;
+	int nDevices=0;
+	cl_char vendor_name[1024];
+	cl_char device_name[1024];
+
+	*found = 1;
+
+	_sclDiscoverDevices();
+	for ( i = 0; i < _sclHardListLength; ++i ) {
+		if ( _sclHardList[i].deviceType == CL_DEVICE_TYPE_GPU ) {
+			nDevices++;
+			if ( nDevices-1 == nDevice ) {
+				if ( !sclOpenHardware( &_sclHardList[i] ) ) {
+					*found = 0;
+				}
+				hardware = _sclHardList[i];
+				break;
+			}
+		}
+	}
+
+	if ( nDevices == 0 ) {
+		fprintf( stderr, "\nNo OpenCL enabled GPU found.\n");
+		*found = 0;
+
+		return hardware;
+	}
+
+	if (nDevice >= nDevices) {
+		fprintf( stderr, "\nNo OpenCL device GPU found.\n");
+		*found = 0;
+
+		return hardware;
+	}
+
+	vendor_name[0] = '\0';
+	device_name[0] = '\0';
+
+	err = (clGetDeviceInfo( hardware.device, CL_DEVICE_VENDOR, sizeof(vendor_name), vendor_name, NULL )
+			 ||clGetDeviceInfo( hardware.device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL ));
+
+	if ( err != CL_SUCCESS ) {
+		fprintf( stderr,  "\nError 2" );
+		sclPrintErrorFlags( err );
+	}
+
+	fprintf( stdout, "\nUsing device vendor: %s\nDevice name: %s\n",vendor_name,device_name);
+
+	return hardware;
+}
+
+sclHard sclGetCPUHardware( int nDevice, int* found ) {
+
+	int i;
+	sclHard hardware;
+	cl_int err;
+	int nDevices=0;
+	cl_char vendor_name[1024];
+	cl_char device_name[1024];
+
+	*found = 1;
+
+	_sclDiscoverDevices();
+	for ( i = 0; i < _sclHardListLength; ++i ) {
+		if ( _sclHardList[i].deviceType == CL_DEVICE_TYPE_CPU ) {
+			nDevices++;
+			if ( nDevices-1 == nDevice ) {
+				if ( !sclOpenHardware( &_sclHardList[i] ) ) {
+					*found = 0;
+				}
+				hardware = _sclHardList[i];
+				break;
+			}
+		}
+	}
+
+	if ( nDevices == 0 ) {
+		fprintf( stderr, "\nNo OpenCL enabled CPU found.\n");
+		*found = 0;
+
+		return hardware;
+	}
+
+	if (nDevice >= nDevices) {
+		fprintf( stderr, "\nNo OpenCL device CPU found.\n");
+		*found = 0;
+
+		return hardware;
+	}
+
+	vendor_name[0] = '\0';
+	device_name[0] = '\0';
+
+	err = (clGetDeviceInfo( hardware.device, CL_DEVICE_VENDOR, sizeof(vendor_name), vendor_name, NULL )
+			 ||clGetDeviceInfo( hardware.device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL ));
+
+	if ( err != CL_SUCCESS ) {
+		fprintf( stderr,  "\nError 2" );
+		sclPrintErrorFlags( err );
+	}
+
+	fprintf( stdout, "\nUsing device vendor: %s\nDevice name: %s\n",vendor_name,device_name);
+
+	return hardware;
+}
+
+/* Program registry. Every program built by sclGetCLSoftware is kept here with a
+   reference counter, so asking again for the same file on the same device and
+   context only costs a clCreateKernel. sclReleaseClSoft drops the reference and
+   the program is released when nobody uses it anymore. */
+
+typedef struct {
+	char* path;
+	char* options;
+	cl_context context;
+	cl_device_id device;
+	cl_program program;
+	int references;
+} _sclProgramEntry;
+
+static _sclProgramEntry* _sclProgramList = NULL;
+static int _sclProgramListLength = 0;
+static int _sclProgramListCapacity = 0;
+static pthread_mutex_t _sclProgramMutex = PTHREAD_MUTEX_INITIALIZER;
+
+char* _sclStrDup( const char* str ) {
+	char* copy;
+
+	if ( str == NULL ) {
+		str = "";
+	}
+	copy = (char*)malloc( strlen( str ) + 1 );
+	strcpy( copy, str );
+
+	return copy;
+}
+
+/* Options that only differ in white space build the same program variant */
+char* _sclNormalizeOptions( const char* options ) {
+	char* normalized;
+	size_t length = 0;
+
+	if ( options == NULL ) {
+		options = "";
+	}
+	normalized = (char*)malloc( strlen( options ) + 1 );
+	while ( *options != '\0' ) {
+		if ( isspace( (unsigned char)*options ) ) {
+			while ( isspace( (unsigned char)*options ) ) {
+				options++;
+			}
+			if ( length > 0 && *options != '\0' ) {
+				normalized[ length++ ] = ' ';
+			}
+		}
+		else {
+			normalized[ length++ ] = *options++;
+		}
+	}
+	normalized[ length ] = '\0';
+
+	return normalized;
+}
+
+cl_program _sclGetRegisteredProgram( const char* path, const char* options, sclHard hardware, const char* pName ) {
+	_sclProgramEntry *entry;
+	cl_program program;
+	cl_device_id device;
+	char *source;
+	int i;
+
+	if ( options == NULL ) {
+		options = "";
+	}
+
+	/* In a shared context the program is built for all its devices */
+	device = _sclGetContextDeviceCount( hardware.context ) > 1 ? NULL : hardware.device;
+
+	/* The lock is held while building, so two threads never build the same program */
+	pthread_mutex_lock( &_sclProgramMutex );
+	for ( i = 0; i < _sclProgramListLength; ++i ) {
+		entry = &_sclProgramList[i];
+		if ( entry->context == hardware.context && entry->device == device &&
+				strcmp( entry->path, path ) == 0 && strcmp( entry->options, options ) == 0 ) {
+			entry->references++;
+			program = entry->program;
+			pthread_mutex_unlock( &_sclProgramMutex );
+			return program;
+		}
+	}
+
+	/* Load program source
+	 ########################################################### */
+	source = _sclLoadProgramSource( path );
+	/* ########################################################### */
+	if ( source == NULL ) {
+		pthread_mutex_unlock( &_sclProgramMutex );
+		return NULL;
+	}
+
+	/* Create and build the program, or load it from the binary cache
+	 ########################################################### */
+	program = _sclGetCachedProgram( source, options, hardware, pName );
+	free( source );
+	/* ########################################################### */
+	if ( program == NULL ) {
+		pthread_mutex_unlock( &_sclProgramMutex );
+		return NULL;
+	}
+
+	if ( _sclProgramListLength == _sclProgramListCapacity ) {
+		_sclProgramListCapacity = _sclProgramListCapacity == 0 ? 8 : 2 * _sclProgramListCapacity;
+		_sclProgramList = (_sclProgramEntry*)realloc( _sclProgramList,
+							      _sclProgramListCapacity * sizeof(_sclProgramEntry) );
+	}
+	entry = &_sclProgramList[ _sclProgramListLength++ ];
+	entry->path       = _sclStrDup( path );
+	entry->options    = _sclStrDup( options );
+	entry->context    = hardware.context;
+	entry->device     = device;
+	entry->program    = program;
+	entry->references = 1;
+	pthread_mutex_unlock( &_sclProgramMutex );
+
+	return program;
+}
+
+void _sclRetainRegisteredProgram( cl_program program ) {
+	int i;
+
+	pthread_mutex_lock( &_sclProgramMutex );
+	for ( i = 0; i < _sclProgramListLength; ++i ) {
+		if ( _sclProgramList[i].program == program ) {
+			_sclProgramList[i].references++;
+			pthread_mutex_unlock( &_sclProgramMutex );
+			return;
+		}
+	}
+	pthread_mutex_unlock( &_sclProgramMutex );
+	clRetainProgram( program );
+}
+
+int _sclReleaseRegisteredProgram( cl_program program ) {
+	int i;
+
+	pthread_mutex_lock( &_sclProgramMutex );
+	for ( i = 0; i < _sclProgramListLength; ++i ) {
+		if ( _sclProgramList[i].program == program ) {
+			if ( --_sclProgramList[i].references == 0 ) {
+				clReleaseProgram( program );
+				free( _sclProgramList[i].path );
+				free( _sclProgramList[i].options );
+				_sclProgramList[i] = _sclProgramList[ --_sclProgramListLength ];
+			}
+			pthread_mutex_unlock( &_sclProgramMutex );
+			return 1;
+		}
+	}
+	pthread_mutex_unlock( &_sclProgramMutex );
+
+	return 0;
+}
+
+sclSoft sclGetCLSoftware( char* path, char* name, sclHard hardware ){
+	sclSoft software;
+	
+	sprintf( software.kernelName, "%s", name);
+	
+	/* Get the program from the registry, building it on first use
+	 ########################################################### */
+	software.program = _sclGetRegisteredProgram( path, NULL, hardware, name );
+	/* ########################################################### */
+	if ( software.program == NULL ) {
+		software.kernel = NULL;
+		return software;
+	}
+   	
+   	/* Create the kernel object
+	 ########################################################################## */
+	software.kernel = _sclCreateKernel( software );
+	/* ########################################################################## */
+
+	return software;
+	
+}
+
+sclSoft sclGetCLSoftwareOptions( char* path, char* name, sclHard hardware, const char* options ) {
+	sclSoft software;
+	char* normalized;
+
+	sprintf( software.kernelName, "%s", name );
+
+	/* Every set of options is a different program variant in the registry
+	 ########################################################### */
+	normalized = _sclNormalizeOptions( options );
+	software.program = _sclGetRegisteredProgram( path, normalized, hardware, name );
+	free( normalized );
+	/* ########################################################### */
+	if ( software.program == NULL ) {
+		software.kernel = NULL;
+		return software;
+	}
+
+	software.kernel = _sclCreateKernel( software );
+
+	return software;
+}
+
+sclSoft* sclGetAllSoftware( char* path, sclHard hardware, int* found ) {
+	sclSoft* softList;
+	cl_program program;
+	cl_kernel* kernels;
+	cl_uint nKernels = 0, i;
+	size_t nameLength;
+	char* name;
+	cl_int err;
+
+	*found = 0;
+
+	program = _sclGetRegisteredProgram( path, NULL, hardware, path );
+	if ( program == NULL ) {
+		return NULL;
+	}
+
+	err = clCreateKernelsInProgram( program, 0, NULL, &nKernels );
+	if ( err != CL_SUCCESS || nKernels == 0 ) {
+		fprintf( stderr, "\nNo kernels found in %s", path );
+		if ( err != CL_SUCCESS ) {
+			sclPrintErrorFlags( err );
+		}
+		_sclReleaseRegisteredProgram( program );
+		return NULL;
+	}
+
+	kernels  = (cl_kernel*)malloc( nKernels * sizeof(cl_kernel) );
+	softList = (sclSoft*)malloc( nKernels * sizeof(sclSoft) );
+	clCreateKernelsInProgram( program, nKernels, kernels, NULL );
+
+	for ( i = 0; i < nKernels; ++i ) {
+		softList[i].program = program;
+		softList[i].kernel  = kernels[i];
+
+		clGetKernelInfo( kernels[i], CL_KERNEL_FUNCTION_NAME, 0, NULL, &nameLength );
+		name = (char*)malloc( nameLength );
+		clGetKernelInfo( kernels[i], CL_KERNEL_FUNCTION_NAME, nameLength, name, NULL );
+		snprintf( softList[i].kernelName, sizeof(softList[i].kernelName), "%s", name );
+		free( name );
+
+		/* Each sclSoft of the list holds its own reference to the program */
+		if ( i > 0 ) {
+			_sclRetainRegisteredProgram( program );
+		}
+	}
+
+	free( kernels );
+	*found = (int)nKernels;
+
+	return softList;
+}
+
+sclSoft sclGetSoftwareByName( sclSoft* softList, int found, const char* name ) {
+	sclSoft software;
+	int i;
+
+	for ( i = 0; i < found; ++i ) {
+		if ( strcmp( softList[i].kernelName, name ) == 0 ) {
+			return softList[i];
+		}
+	}
+
+	fprintf( stderr, "\nNo kernel named %s in the software list", name );
+	software.program = NULL;
+	software.kernel  = NULL;
+	snprintf( software.kernelName, sizeof(software.kernelName), "%s", name );
+
+	return software;
+}
+
+void sclReleaseAllSoftware( sclSoft* softList, int found ) {
+	int i;
+
+	for ( i = 0; i < found; ++i ) {
+		sclReleaseClSoft( softList[i] );
+	}
+	free( softList );
+
+}
+
+/* Device buffer pool. Buffers handed out by sclMalloc are rounded up to a size
+   class and, when released with sclReleaseMemObject, kept in a free list of the
+   context and command queue they were allocated for instead of being destroyed.
+   Reusing a buffer on the same in-order queue keeps pending commands on it safe.
+   When the context has more queues (sclCreateQueues, shared contexts) a marker
+   is enqueued on each of them at release, and the buffer is only handed out
+   again after all of them complete. Buffers of out-of-order queues are not
+   pooled. Releasing a queue forgets all its buffers, free or in use. */
+
+typedef struct {
+	cl_context context;
+	cl_command_queue queue;
+	cl_mem_flags flags;
+	size_t size;
+	cl_mem buffer;
+	cl_event* events;
+	int nEvents;
+} _sclPoolBuffer;
+
+typedef struct {
+	cl_command_queue queue;
+	int outOfOrder;
+} _sclQueueOrder;
+
+static _sclQueueOrder* _sclQueueOrders = NULL;
+static int _sclQueueOrdersLength = 0;
+
+static _sclPoolBuffer* _sclPoolFree = NULL;
+static int _sclPoolFreeLength = 0, _sclPoolFreeCapacity = 0;
+static _sclPoolBuffer* _sclPoolUsed = NULL;
+static int _sclPoolUsedLength = 0, _sclPoolUsedCapacity = 0;
+static size_t _sclPoolLimit = 256 * 1024 * 1024;
+static sclPoolStats _sclPoolStatistics = { 0, 0, 0, 0, 0.0 };
+static pthread_mutex_t _sclPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+
+size_t _sclPoolSizeClass( size_t size ) {
+	size_t power = 4096, granule;
+
+	if ( size <= 4096 ) {
+		return 4096;
+	}
+	while ( power <= size / 2 ) {
+		power *= 2;
+	}
+	/* Four classes per power of two, so at most 25% of a buffer is wasted */
+	granule = power / 4;
+
+	return ( size + granule - 1 ) / granule * granule;
+}
+
+int _sclIsOutOfOrderQueue( cl_command_queue queue ) {
+	cl_command_queue_properties properties = 0;
+	int i, outOfOrder;
+
+	/* Queried once per queue, the entry goes away with _sclPoolDropQueue */
+	pthread_mutex_lock( &_sclPoolMutex );
+	for ( i = 0; i < _sclQueueOrdersLength; ++i ) {
+		if ( _sclQueueOrders[i].queue == queue ) {
+			outOfOrder = _sclQueueOrders[i].outOfOrder;
+			pthread_mutex_unlock( &_sclPoolMutex );
+			return outOfOrder;
+		}
+	}
+	clGetCommandQueueInfo( queue, CL_QUEUE_PROPERTIES, sizeof(properties), &properties, NULL );
+	_sclQueueOrders = (_sclQueueOrder*)realloc( _sclQueueOrders, ( _sclQueueOrdersLength + 1 ) * sizeof(_sclQueueOrder) );
+	_sclQueueOrders[ _sclQueueOrdersLength ].queue      = queue;
+	_sclQueueOrders[ _sclQueueOrdersLength ].outOfOrder = ( properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE ) != 0;
+	outOfOrder = _sclQueueOrders[ _sclQueueOrdersLength++ ].outOfOrder;
+	pthread_mutex_unlock( &_sclPoolMutex );
+
+	return outOfOrder;
+}
+
+/* One marker on every queue of the context, or none if the buffer's queue is
+   the only one and its order already protects the pending commands */
+int _sclPoolReleaseMarkers( cl_context context, cl_command_queue queue, cl_event** events ) {
+	cl_command_queue* queues;
+	int i, j, nQueues = 0, others = 0;
+
+	*events = NULL;
+	queues = (cl_command_queue*)malloc( ( _sclHardListLength + 1 ) * sizeof(cl_command_queue) );
+	for ( i = 0; i < _sclHardListLength; ++i ) {
+		if ( _sclHardList[i].context != context || _sclHardList[i].queue == NULL ) {
+			continue;
+		}
+		others += _sclHardList[i].nQueues;
+		queues = (cl_command_queue*)realloc( queues, ( nQueues + 1 + _sclHardList[i].nQueues ) * sizeof(cl_command_queue) );
+		queues[ nQueues++ ] = _sclHardList[i].queue;
+		for ( j = 0; j < _sclHardList[i].nQueues; ++j ) {
+			queues[ nQueues++ ] = _sclHardList[i].queues[j];
+		}
+	}
+	if ( nQueues == 0 || ( nQueues == 1 && queues[0] == queue && others == 0 ) ) {
+		free( queues );
+		return 0;
+	}
+
+	*events = (cl_event*)malloc( nQueues * sizeof(cl_event) );
+	for ( i = 0, j = 0; i < nQueues; ++i ) {
+		if ( clEnqueueMarker( queues[i], &(*events)[j] ) == CL_SUCCESS ) {
+			clFlush( queues[i] );
+			j++;
+		}
+	}
+	free( queues );
+
+	return j;
+}
+
+void _sclPoolReleaseEvents( _sclPoolBuffer* entry ) {
+	int i;
+
+	for ( i = 0; i < entry->nEvents; ++i ) {
+		clReleaseEvent( entry->events[i] );
+	}
+	free( entry->events );
+	entry->events  = NULL;
+	entry->nEvents = 0;
+}
+
+void _sclPoolPush( _sclPoolBuffer** list, int* length, int* capacity, _sclPoolBuffer entry ) {
+	if ( *length == *capacity ) {
+		*capacity = *capacity == 0 ? 32 : 2 * *capacity;
+		*list = (_sclPoolBuffer*)realloc( *list, *capacity * sizeof(_sclPoolBuffer) );
+	}
+	(*list)[ (*length)++ ] = entry;
+}
+
+cl_mem _sclCreateBuffer( sclHard hardware, cl_int mode, size_t size, cl_int* err ) {
+	cl_mem buffer;
+
+	buffer = clCreateBuffer( hardware.context, mode, size, NULL, err );
+	if ( *err == CL_MEM_OBJECT_ALLOCATION_FAILURE || *err == CL_OUT_OF_RESOURCES ) {
+		/* The memory may be held by cached buffers */
+		sclTrimBufferPool( 0 );
+		buffer = clCreateBuffer( hardware.context, mode, size, NULL, err );
+	}
+
+	return buffer;
+}
+
+cl_mem sclMalloc( sclHard hardware, cl_int mode, size_t size ){
+	cl_mem buffer;
+	cl_int err;
+	_sclPoolBuffer entry, cached;
+	int i;
+
+	entry.context = hardware.context;
+	entry.queue   = hardware.queue;
+	entry.flags   = (cl_mem_flags)mode;
+	entry.size    = _sclPoolSizeClass( size );
+	entry.events  = NULL;
+	entry.nEvents = 0;
+
+	if ( size == 0 || ( mode & ( CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR ) ) ||
+			entry.size > hardware.maxPointerSize || _sclIsOutOfOrderQueue( hardware.queue ) ) {
+		/* Not poolable, a plain buffer is created */
+		buffer = _sclCreateBuffer( hardware, mode, size, &err );
+		if ( err != CL_SUCCESS ) {
+			fprintf( stderr,  "\nclMalloc Error\n" );
+			sclPrintErrorFlags( err );
+		}
+		return buffer;
+	}
+
+	pthread_mutex_lock( &_sclPoolMutex );
+	for ( i = _sclPoolFreeLength - 1; i >= 0; --i ) {
+		if ( _sclPoolFree[i].context == entry.context && _sclPoolFree[i].queue == entry.queue &&
+				_sclPoolFree[i].flags == entry.flags && _sclPoolFree[i].size == entry.size ) {
+			cached = _sclPoolFree[i];
+			_sclPoolFree[i] = _sclPoolFree[ --_sclPoolFreeLength ];
+			entry.buffer = cached.buffer;
+			_sclPoolStatistics.hits++;
+			_sclPoolStatistics.bytesCached -= entry.size;
+			_sclPoolStatistics.bytesInUse  += entry.size;
+			_sclPoolPush( &_sclPoolUsed, &_sclPoolUsedLength, &_sclPoolUsedCapacity, entry );
+			pthread_mutex_unlock( &_sclPoolMutex );
+
+			/* Commands sent to other queues before the release must be done */
+			if ( cached.nEvents > 0 ) {
+				clWaitForEvents( cached.nEvents, cached.events );
+			}
+			_sclPoolReleaseEvents( &cached );
+			return entry.buffer;
+		}
+	}
+	pthread_mutex_unlock( &_sclPoolMutex );
+
+	entry.buffer = _sclCreateBuffer( hardware, mode, entry.size, &err );
+	if ( err != CL_SUCCESS ) {
+		fprintf( stderr,  "\nclMalloc Error\n" );
+		sclPrintErrorFlags( err );
+		return entry.buffer;
+	}
+	pthread_mutex_lock( &_sclPoolMutex );
+	_sclPoolStatistics.misses++;
+	_sclPoolStatistics.bytesInUse += entry.size;
+	_sclPoolPush( &_sclPoolUsed, &_sclPoolUsedLength, &_sclPoolUsedCapacity, entry );
+	pthread_mutex_unlock( &_sclPoolMutex );
+		
+	return entry.buffer;
+}	
+
+int _sclPoolRelease( cl_mem object ) {
+	_sclPoolBuffer entry;
+	int i;
+
+	pthread_mutex_lock( &_sclPoolMutex );
+	for ( i = _sclPoolUsedLength - 1; i >= 0; --i ) {
+		if ( _sclPoolUsed[i].buffer == object ) {
+			entry = _sclPoolUsed[i];
+			_sclPoolUsed[i] = _sclPoolUsed[ --_sclPoolUsedLength ];
+			_sclPoolStatistics.bytesInUse -= entry.size;
+
+			if ( _sclPoolStatistics.bytesCached + entry.size > _sclPoolLimit ) {
+				_sclPoolTrim( _sclPoolLimit > entry.size ? _sclPoolLimit - entry.size : 0 );
+			}
+			if ( _sclPoolStatistics.bytesCached + entry.size > _sclPoolLimit ) {
+				clReleaseMemObject( object );
+			}
+			else {
+				entry.nEvents = _sclPoolReleaseMarkers( entry.context, entry.queue, &entry.events );
+				_sclPoolPush( &_sclPoolFree, &_sclPoolFreeLength, &_sclPoolFreeCapacity, entry );
+				_sclPoolStatistics.bytesCached += entry.size;
+			}
+			pthread_mutex_unlock( &_sclPoolMutex );
+			return 1;
+		}
+	}
+	pthread_mutex_unlock( &_sclPoolMutex );
+
+	return 0;
+}
+
+/* Callers hold _sclPoolMutex */
+void _sclPoolTrim( size_t maxCachedBytes ) {
+	int i, kept = 0;
+
+	/* Oldest buffers go first */
+	for ( i = 0; i < _sclPoolFreeLength; ++i ) {
+		if ( _sclPoolStatistics.bytesCached > maxCachedBytes ) {
+			_sclPoolReleaseEvents( &_sclPoolFree[i] );
+			clReleaseMemObject( _sclPoolFree[i].buffer );
+			_sclPoolStatistics.bytesCached -= _sclPoolFree[i].size;
+		}
+		else {
+			_sclPoolFree[ kept++ ] = _sclPoolFree[i];
+		}
+	}
+	_sclPoolFreeLength = kept;
+}
+
+void _sclPoolDetach( cl_mem object ) {
+	int i;
+
+	/* The buffer stays valid, sclReleaseMemObject destroys it */
+	pthread_mutex_lock( &_sclPoolMutex );
+	for ( i = _sclPoolUsedLength - 1; i >= 0; --i ) {
+		if ( _sclPoolUsed[i].buffer == object ) {
+			_sclPoolStatistics.bytesInUse -= _sclPoolUsed[i].size;
+			_sclPoolUsed[i] = _sclPoolUsed[ --_sclPoolUsedLength ];
+			break;
+		}
+	}
+	pthread_mutex_unlock( &_sclPoolMutex );
+}
+
+void sclTrimBufferPool( size_t maxCachedBytes ) {
+	pthread_mutex_lock( &_sclPoolMutex );
+	_sclPoolTrim( maxCachedBytes );
+	pthread_mutex_unlock( &_sclPoolMutex );
+}
+
+void _sclPoolDropQueue( cl_command_queue queue ) {
+	int i, kept = 0;
+
+	pthread_mutex_lock( &_sclPoolMutex );
+	for ( i = 0; i < _sclPoolFreeLength; ++i ) {
+		if ( _sclPoolFree[i].queue == queue ) {
+			_sclPoolReleaseEvents( &_sclPoolFree[i] );
+			clReleaseMemObject( _sclPoolFree[i].buffer );
+			_sclPoolStatistics.bytesCached -= _sclPoolFree[i].size;
+		}
+		else {
+			_sclPoolFree[ kept++ ] = _sclPoolFree[i];
+		}
+	}
+	_sclPoolFreeLength = kept;
+
+	/* Buffers still in use are no longer pooled, sclReleaseMemObject destroys them */
+	for ( i = 0, kept = 0; i < _sclPoolUsedLength; ++i ) {
+		if ( _sclPoolUsed[i].queue == queue ) {
+			_sclPoolStatistics.bytesInUse -= _sclPoolUsed[i].size;
+		}
+		else {
+			_sclPoolUsed[ kept++ ] = _sclPoolUsed[i];
+		}
+	}
+	_sclPoolUsedLength = kept;
+
+	/* A new queue may get the same address */
+	for ( i = 0, kept = 0; i < _sclQueueOrdersLength; ++i ) {
+		if ( _sclQueueOrders[i].queue != queue ) {
+			_sclQueueOrders[ kept++ ] = _sclQueueOrders[i];
+		}
+	}
+	_sclQueueOrdersLength = kept;
+	pthread_mutex_unlock( &_sclPoolMutex );
+}
+
+void sclSetBufferPoolLimit( size_t maxCachedBytes ) {
+	pthread_mutex_lock( &_sclPoolMutex );
+	_sclPoolLimit = maxCachedBytes;
+	_sclPoolTrim( maxCachedBytes );
+	pthread_mutex_unlock( &_sclPoolMutex );
+}
+
+sclPoolStats sclGetBufferPoolStats( void ) {
+	sclPoolStats stats;
+	unsigned long requests;
+
+	pthread_mutex_lock( &_sclPoolMutex );
+	stats = _sclPoolStatistics;
+	pthread_mutex_unlock( &_sclPoolMutex );
+	requests = stats.hits + stats.misses;
+
+	stats.hitRate = requests > 0 ? (double)stats.hits / (double)requests : 0.0;
+
+	return stats;
+}
+
+/* Zero-copy buffers. A page-aligned host array is used by the device in place
+   (CL_MEM_USE_HOST_PTR), otherwise the runtime allocates host accessible memory
+   (CL_MEM_ALLOC_HOST_PTR). In both cases the data is accessed through sclMap and
+   sclUnmap, which on unified memory devices do not copy anything. */
+
+size_t _sclGetPageSize( void ) {
+	long pageSize = sysconf( _SC_PAGESIZE );
+
+	return pageSize > 0 ? (size_t)pageSize : 4096;
+}
+
+int _sclIsPageAligned( const void* pointer ) {
+	return ( (size_t)pointer % _sclGetPageSize() ) == 0;
+}
+
+cl_mem sclMallocHost( sclHard hardware, cl_int mode, size_t size, void* hostPointer ) {
+	cl_mem buffer;
+	cl_int err;
+	cl_mem_flags flags;
+
+	flags = (cl_mem_flags)mode & ~(cl_mem_flags)( CL_MEM_USE_HOST_PTR | CL_MEM_ALLOC_HOST_PTR | CL_MEM_COPY_HOST_PTR );
+
+	if ( hostPointer != NULL && _sclIsPageAligned( hostPointer ) ) {
+		flags |= CL_MEM_USE_HOST_PTR;
+	}
+	else if ( hostPointer != NULL ) {
+		flags |= CL_MEM_ALLOC_HOST_PTR | CL_MEM_COPY_HOST_PTR;
+	}
+	else {
+		flags |= CL_MEM_ALLOC_HOST_PTR;
+	}
+
+	buffer = clCreateBuffer( hardware.context, flags, size, hostPointer, &err );
+	if ( err != CL_SUCCESS ) {
+		fprintf( stderr,  "\nclMallocHost Error\n" );
+		sclPrintErrorFlags( err );
+		return NULL;
+	}
+
+	return buffer;
+}
+
+void* _sclMapBuffer( sclHard hardware, cl_mem buffer, cl_map_flags flags, size_t offset, size_t size,
+		     cl_uint num_events_in_wait_list, const cl_event *event_wait_list ) {
+	void* mapped;
+	cl_event myEvent=NULL;
+	cl_int err;
+
+	mapped = clEnqueueMapBuffer( hardware.queue, buffer, CL_TRUE, flags, offset, size,
+				     num_events_in_wait_list, event_wait_list, _sclProfileSlot( &myEvent ), &err );
+	if ( err != CL_SUCCESS ) {
+		fprintf( stderr,  "\nclMap Error\n" );
+		sclPrintErrorFlags( err );
+		return NULL;
+	}
+	_sclProfileCommand( hardware, myEvent, "sclMap", "transfer", size );
+	sclReleaseEvent( myEvent );
+
+	return mapped;
+}
+
+void* sclMap( sclHard hardware, cl_mem buffer, cl_map_flags flags, size_t offset, size_t size ) {
+	return _sclMapBuffer( hardware, buffer, flags, offset, size, 0, NULL );
+}
+
+void sclUnmap( sclHard hardware, cl_mem buffer, void* mappedPointer ) {
+#ifdef DEBUG
+	cl_int err;
+
+	err = clEnqueueUnmapMemObject( hardware.queue, buffer, mappedPointer, 0, NULL, NULL );
+	if ( err != CL_SUCCESS ) {
+		fprintf( stderr,  "\nclUnmap Error\n" );
+		sclPrintErrorFlags( err );
+	}
+#else
+	clEnqueueUnmapMemObject( hardware.queue, buffer, mappedPointer, 0, NULL, NULL );
+#endif
+}
+
+/* Managed buffers. A host array and its device buffer, with a flag for the side
+   that holds the newest copy. Data is only copied when the other side asks for
+   it, so a buffer can stay on the device across many launches. The host array
+   belongs to the user, who must call sclBufferHostModified after writing it. */
+
+sclBuffer* sclCreateBuffer( sclHard hardware, cl_int mode, size_t size, void* hostPointer ) {
+	sclBuffer* buffer;
+
+	buffer = (sclBuffer*)malloc( sizeof(sclBuffer) );
+	buffer->hardware    = hardware;
+	buffer->size        = size;
+	buffer->host        = hostPointer;
+	buffer->buffer      = sclMalloc( hardware, mode, size );
+	buffer->hostDirty   = hostPointer != NULL;
+	buffer->deviceDirty = 0;
+	if ( buffer->buffer == NULL ) {
+		free( buffer );
+		return NULL;
+	}
+
+	return buffer;
+}
+
+cl_mem sclBufferDevice( sclBuffer* buffer ) {
+	if ( buffer->hostDirty ) {
+		sclWrite( buffer->hardware, buffer->size, buffer->buffer, buffer->host );
+		buffer->hostDirty = 0;
+	}
+
+	return buffer->buffer;
+}
+
+void* sclBufferHost( sclBuffer* buffer ) {
+	if ( buffer->deviceDirty && buffer->host != NULL ) {
+		sclRead( buffer->hardware, buffer->size, buffer->buffer, buffer->host );
+		buffer->deviceDirty = 0;
+	}
+
+	return buffer->host;
+}
+
+void sclBufferHostModified( sclBuffer* buffer ) {
+	buffer->hostDirty   = buffer->host != NULL;
+	buffer->deviceDirty = 0;
+}
+
+void sclBufferDeviceModified( sclBuffer* buffer ) {
+	buffer->deviceDirty = 1;
+	buffer->hostDirty   = 0;
+}
+
+void sclReleaseBuffer( sclBuffer* buffer ) {
+	if ( buffer == NULL ) {
+		return;
+	}
+	sclReleaseMemObject( buffer->buffer );
+	free( buffer );
+}
+
+/* Pinned host memory. Every block is a CL_MEM_ALLOC_HOST_PTR buffer that stays
+   mapped while it lives, so the driver can copy from it without going through
+   its own staging buffer. Freed blocks are kept for the next allocation of the
+   same size class on the same context and queue, up to _sclHostPoolLimit bytes.
+   A block still in use when its queue is released is detached (queue NULL) and
+   destroyed by sclHostFree. */
+
+typedef struct {
+	cl_context context;
+	cl_command_queue queue;
+	cl_mem buffer;
+	void* mapped;
+	void* pointer;
+	size_t size;
+	int used;
+} _sclHostBlock;
+
+static _sclHostBlock* _sclHostBlocks = NULL;
+static int _sclHostBlocksLength = 0, _sclHostBlocksCapacity = 0;
+static size_t _sclHostPoolLimit = 256 * 1024 * 1024;
+static pthread_mutex_t _sclHostMutex = PTHREAD_MUTEX_INITIALIZER;
+
+void* sclHostAlloc( sclHard hardware, size_t size ) {
+	_sclHostBlock block;
+	size_t pageSize = _sclGetPageSize();
+	cl_int err;
+	int i;
+
+	block.size = _sclPoolSizeClass( size );
+
+	pthread_mutex_lock( &_sclHostMutex );
+	for ( i = 0; i < _sclHostBlocksLength; ++i ) {
+		if ( !_sclHostBlocks[i].used && _sclHostBlocks[i].context == hardware.context &&
+				_sclHostBlocks[i].queue == hardware.queue && _sclHostBlocks[i].size == block.size ) {
+			_sclHostBlocks[i].used = 1;
+			pthread_mutex_unlock( &_sclHostMutex );
+			return _sclHostBlocks[i].pointer;
+		}
+	}
+	/* The new block is created and mapped without holding the lock */
+	pthread_mutex_unlock( &_sclHostMutex );
+
+	/* One extra page lets the returned pointer start on a page boundary */
+	block.buffer = _sclCreateBuffer( hardware, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, block.size + pageSize, &err );
+	if ( err != CL_SUCCESS ) {
+		fprintf( stderr,  "\nclHostAlloc Error on clCreateBuffer\n" );
+		sclPrintErrorFlags( err );
+		return NULL;
+	}
+	block.mapped = clEnqueueMapBuffer( hardware.queue, block.buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0,
+					   block.size + pageSize, 0, NULL, NULL, &err );
+	if ( err != CL_SUCCESS ) {
+		fprintf( stderr,  "\nclHostAlloc Error on clEnqueueMapBuffer\n" );
+		sclPrintErrorFlags( err );
+		clReleaseMemObject( block.buffer );
+		return NULL;
+	}
+	block.pointer = (void*)( ( (size_t)block.mapped + pageSize - 1 ) / pageSize * pageSize );
+	block.context = hardware.context;
+	block.queue   = hardware.queue;
+	block.used    = 1;
+
+	pthread_mutex_lock( &_sclHostMutex );
+	if ( _sclHostBlocksLength == _sclHostBlocksCapacity ) {
+		_sclHostBlocksCapacity = _sclHostBlocksCapacity == 0 ? 16 : 2 * _sclHostBlocksCapacity;
+		_sclHostBlocks = (_sclHostBlock*)realloc( _sclHostBlocks, _sclHostBlocksCapacity * sizeof(_sclHostBlock) );
+	}
+	_sclHostBlocks[ _sclHostBlocksLength++ ] = block;
+	pthread_mutex_unlock( &_sclHostMutex );
+
+	return block.pointer;
+}
+
+void sclHostFree( void* pointer ) {
+	int i;
+
+	if ( pointer == NULL ) {
+		return;
+	}
+	pthread_mutex_lock( &_sclHostMutex );
+	for ( i = 0; i < _sclHostBlocksLength; ++i ) {
+		if ( _sclHostBlocks[i].used && _sclHostBlocks[i].pointer == pointer ) {
+			if ( _sclHostBlocks[i].queue == NULL ) {
+				/* Its queue is gone, the mapping goes with the buffer */
+				clReleaseMemObject( _sclHostBlocks[i].buffer );
+				_sclHostBlocks[i] = _sclHostBlocks[ --_sclHostBlocksLength ];
+			}
+			else {
+				_sclHostBlocks[i].used = 0;
+				_sclHostTrim( _sclHostPoolLimit );
+			}
+			pthread_mutex_unlock( &_sclHostMutex );
+			return;
+		}
+	}
+	pthread_mutex_unlock( &_sclHostMutex );
+	fprintf( stderr, "\nclHostFree Error: pointer not allocated with sclHostAlloc\n" );
+}
+
+void sclTrimHostPool( size_t maxCachedBytes ) {
+	pthread_mutex_lock( &_sclHostMutex );
+	_sclHostTrim( maxCachedBytes );
+	pthread_mutex_unlock( &_sclHostMutex );
+}
+
+/* Callers hold _sclHostMutex */
+void _sclHostTrim( size_t maxCachedBytes ) {
+	size_t cached = 0;
+	int i, kept = 0;
+
+	for ( i = 0; i < _sclHostBlocksLength; ++i ) {
+		if ( !_sclHostBlocks[i].used ) {
+			cached += _sclHostBlocks[i].size;
+		}
+	}
+
+	/* Oldest blocks go first */
+	for ( i = 0; i < _sclHostBlocksLength; ++i ) {
+		if ( !_sclHostBlocks[i].used && cached > maxCachedBytes ) {
+			clEnqueueUnmapMemObject( _sclHostBlocks[i].queue, _sclHostBlocks[i].buffer, _sclHostBlocks[i].mapped, 0, NULL, NULL );
+			clReleaseMemObject( _sclHostBlocks[i].buffer );
+			cached -= _sclHostBlocks[i].size;
+		}
+		else {
+			_sclHostBlocks[ kept++ ] = _sclHostBlocks[i];
+		}
+	}
+	_sclHostBlocksLength = kept;
+}
+
+void sclSetHostPoolLimit( size_t maxCachedBytes ) {
+	pthread_mutex_lock( &_sclHostMutex );
+	_sclHostPoolLimit = maxCachedBytes;
+	_sclHostTrim( maxCachedBytes );
+	pthread_mutex_unlock( &_sclHostMutex );
+}
+
+int _sclIsHostAllocated( const void* pointer, size_t size ) {
+	const unsigned char* begin;
+	int i, found = 0;
+
+	pthread_mutex_lock( &_sclHostMutex );
+	for ( i = 0; i < _sclHostBlocksLength && !found; ++i ) {
+		begin = (const unsigned char*)_sclHostBlocks[i].pointer;
+		if ( _sclHostBlocks[i].used && (const unsigned char*)pointer >= begin &&
+				(const unsigned char*)pointer + size <= begin + _sclHostBlocks[i].size ) {
+			found = 1;
+		}
+	}
+	pthread_mutex_unlock( &_sclHostMutex );
+
+	return found;
+}
+
+void _sclHostDropQueue( cl_command_queue queue ) {
+	int i, kept = 0;
+
+	pthread_mutex_lock( &_sclHostMutex );
+	for ( i = 0; i < _sclHostBlocksLength; ++i ) {
+		if ( _sclHostBlocks[i].queue != queue ) {
+			_sclHostBlocks[ kept++ ] = _sclHostBlocks[i];
+		}
+		else if ( !_sclHostBlocks[i].used ) {
+			clEnqueueUnmapMemObject( queue, _sclHostBlocks[i].buffer, _sclHostBlocks[i].mapped, 0, NULL, NULL );
+			clReleaseMemObject( _sclHostBlocks[i].buffer );
+		}
+		else {
+			/* A new queue may get the same address, the block must not match it */
+			_sclHostBlocks[i].queue = NULL;
+			_sclHostBlocks[ kept++ ] = _sclHostBlocks[i];
+		}
+	}
+	_sclHostBlocksLength = kept;
+	pthread_mutex_unlock( &_sclHostMutex );
+	clFinish( queue );
+}
+
+cl_mem sclMallocWrite( sclHard hardware, cl_int mode, size_t size, void* hostPointer ){
+	cl_mem buffer;
+	cl_event myEvent=NULL;
+
+	buffer = sclMalloc( hardware, mode, size );
+
+#ifdef DEBUG
+	cl_int err;
+	
+	if ( buffer == NULL ) { 
+		fprintf( stderr,  "\nclMallocWrite Error on clCreateBuffer\n" );
+	}
+	err = clEnqueueWriteBuffer( hardware.queue, buffer, CL_TRUE, 0, size, hostPointer, 0, NULL, _sclProfileSlot( &myEvent ) );
+	if ( err != CL_SUCCESS ) { 
+		fprintf( stderr,  "\nclMallocWrite Error on clEnqueueWriteBuffer\n" );
+		sclPrintErrorFlags( err );
+	}
+
+#else
+	clEnqueueWriteBuffer( hardware.queue, buffer, CL_TRUE, 0, size, hostPointer, 0, NULL, _sclProfileSlot( &myEvent ) );
+#endif
+	_sclProfileCommand( hardware, myEvent, "sclMallocWrite", "transfer", size );
+	sclReleaseEvent( myEvent );
+	return buffer;
+}
+
+void sclWrite( sclHard hardware, size_t size, cl_mem buffer, void* hostPointer ) {
+	cl_event myEvent=NULL;
+#ifdef DEBUG
+	cl_int err;
+
+	err = clEnqueueWriteBuffer( hardware.queue, buffer, CL_TRUE, 0, size, hostPointer, 0, NULL, _sclProfileSlot( &myEvent ) );
+	if ( err != CL_SUCCESS ) { 
+		fprintf( stderr,  "\nclWrite Error\n" );
+		sclPrintErrorFlags( err );
+	}   
+#else
+	clEnqueueWriteBuffer( hardware.queue, buffer, CL_TRUE, 0, size, hostPointer, 0, NULL, _sclProfileSlot( &myEvent ) );
+#endif
+	_sclProfileCommand( hardware, myEvent, "sclWrite", "transfer", size );
+	sclReleaseEvent( myEvent );
+}
+
+void sclRead( sclHard hardware, size_t size, cl_mem buffer, void *hostPointer ) {
+	cl_event myEvent=NULL;
+#ifdef DEBUG
+	cl_int err;
+
+	err = clEnqueueReadBuffer( hardware.queue, buffer, CL_TRUE, 0, size, hostPointer, 0, NULL, _sclProfileSlot( &myEvent ) );
+	if ( err != CL_SUCCESS ) {
+		fprintf( stderr,  "\nclRead Error\n" );
+		sclPrintErrorFlags( err );
+       	}
+#else
+	clEnqueueReadBuffer( hardware.queue, buffer, CL_TRUE, 0, size, hostPointer, 0, NULL, _sclProfileSlot( &myEvent ) );
+#endif
+	_sclProfileCommand( hardware, myEvent, "sclRead", "transfer", size );
+	sclReleaseEvent( myEvent );
+}
+
+/* Partial transfers. Only a range, or a 3D box, of the buffer crosses the bus.
+   Rectangle origins and regions are given as { bytes, rows, slices }, and a
+   pitch of 0 lets OpenCL compute it from the region. */
+
+void sclWriteOffset( sclHard hardware, size_t offset, size_t size, cl_mem buffer, void* hostPointer ) {
+	cl_event myEvent=NULL;
+#ifdef DEBUG
+	cl_int err;
+
+	err = clEnqueueWriteBuffer( hardware.queue, buffer, CL_TRUE, offset, size, hostPointer, 0, NULL, _sclProfileSlot( &myEvent ) );
+	if ( err != CL_SUCCESS ) {
+		fprintf( stderr,  "\nclWriteOffset Error\n" );
+		sclPrintErrorFlags( err );
+	}
+#else
+	clEnqueueWriteBuffer( hardware.queue, buffer, CL_TRUE, offset, size, hostPointer, 0, NULL, _sclProfileSlot( &myEvent ) );
+#endif
+	_sclProfileCommand( hardware, myEvent, "sclWriteOffset", "transfer", size );
+	sclReleaseEvent( myEvent );
+}
+
+void sclReadOffset( sclHard hardware, size_t offset, size_t size, cl_mem buffer, void* hostPointer ) {
+	cl_event myEvent=NULL;
+#ifdef DEBUG
+	cl_int err;
+
+	err = clEnqueueReadBuffer( hardware.queue, buffer, CL_TRUE, offset, size, hostPointer, 0, NULL, _sclProfileSlot( &myEvent ) );
+	if ( err != CL_SUCCESS ) {
+		fprintf( stderr,  "\nclReadOffset Error\n" );
+		sclPrintErrorFlags( err );
+	}
+#else
+	clEnqueueReadBuffer( hardware.queue, buffer, CL_TRUE, offset, size, hostPointer, 0, NULL, _sclProfileSlot( &myEvent ) );
+#endif
+	_sclProfileCommand( hardware, myEvent, "sclReadOffset", "transfer", size );
+	sclReleaseEvent( myEvent );
+}
+
+void sclWriteRect( sclHard hardware, cl_mem buffer, const size_t* bufferOrigin, const size_t* hostOrigin,
+		   const size_t* region, size_t bufferRowPitch, size_t bufferSlicePitch,
+		   size_t hostRowPitch, size_t hostSlicePitch, void* hostPointer ) {
+	cl_event myEvent=NULL;
+#ifdef DEBUG
+	cl_int err;
+
+	err = clEnqueueWriteBufferRect( hardware.queue, buffer, CL_TRUE, bufferOrigin, hostOrigin, region,
+					bufferRowPitch, bufferSlicePitch, hostRowPitch, hostSlicePitch, hostPointer,
+					0, NULL, _sclProfileSlot( &myEvent ) );
+	if ( err != CL_SUCCESS ) {
+		fprintf( stderr,  "\nclWriteRect Error\n" );
+		sclPrintErrorFlags( err );
+	}
+#else
+	clEnqueueWriteBufferRect( hardware.queue, buffer, CL_TRUE, bufferOrigin, hostOrigin, region,
+				bufferRowPitch, bufferSlicePitch, hostRowPitch, hostSlicePitch, hostPointer,
+				0, NULL, _sclProfileSlot( &myEvent ) );
+#endif
+	_sclProfileCommand( hardware, myEvent, "sclWriteRect", "transfer", region[0] * region[1] * region[2] );
+	sclReleaseEvent( myEvent );
+}
+
+void sclReadRect( sclHard hardware, cl_mem buffer, const size_t* bufferOrigin, const size_t* hostOrigin,
+		  const size_t* region, size_t bufferRowPitch, size_t bufferSlicePitch,
+		  size_t hostRowPitch, size_t hostSlicePitch, void* hostPointer ) {
+	cl_event myEvent=NULL;
+#ifdef DEBUG
+	cl_int err;
+
+	err = clEnqueueReadBufferRect( hardware.queue, buffer, CL_TRUE, bufferOrigin, hostOrigin, region,
+				       bufferRowPitch, bufferSlicePitch, hostRowPitch, hostSlicePitch, hostPointer,
+				       0, NULL, _sclProfileSlot( &myEvent ) );
+	if ( err != CL_SUCCESS ) {
+		fprintf( stderr,  "\nclReadRect Error\n" );
+		sclPrintErrorFlags( err );
+	}
+#else
+	clEnqueueReadBufferRect( hardware.queue, buffer, CL_TRUE, bufferOrigin, hostOrigin, region,
+				       bufferRowPitch, bufferSlicePitch, hostRowPitch, hostSlicePitch, hostPointer,
+				       0, NULL, _sclProfileSlot( &myEvent ) );
+#endif
+	_sclProfileCommand( hardware, myEvent, "sclReadRect", "transfer", region[0] * region[1] * region[2] );
+	sclReleaseEvent( myEvent );
+}
+
+/* Sub-buffers must start at a multiple of CL_DEVICE_MEM_BASE_ADDR_ALIGN. The
+   parent leaves the buffer pool, a recycled parent would be handed to another
+   sclMalloc while its sub-buffers still use it. */
+cl_mem sclCreateSubBuffer( sclHard hardware, cl_mem buffer, cl_mem_flags mode, size_t origin, size_t size ) {
+	cl_buffer_region region;
+	cl_mem subBuffer;
+	size_t align;
+	cl_int err;
+
+	align = _sclGetMemBaseAddrAlign( hardware.device );
+	if ( origin % align != 0 ) {
+		fprintf( stderr, "\nclCreateSubBuffer Error: origin %lu is not a multiple of %lu bytes\n",
+			 (unsigned long)origin, (unsigned long)align );
+		return NULL;
+	}
+
+	region.origin = origin;
+	region.size   = size;
+	subBuffer = clCreateSubBuffer( buffer, mode, CL_BUFFER_CREATE_TYPE_REGION, &region, &err );
+	if ( err != CL_SUCCESS ) {
+		fprintf( stderr, "\nclCreateSubBuffer Error\n" );
+		sclPrintErrorFlags( err );
+		return NULL;
+	}
+	_sclPoolDetach( buffer );
+
+	return subBuffer;
+}
+
+cl_event sclWriteAsync( sclHard hardware, size_t offset, size_t size, cl_mem buffer, void* hostPointer,
+			cl_uint num_events_in_wait_list, const cl_event *event_wait_list ) {
+	cl_event myEvent=NULL;
+	cl_int err;
+
+	err = clEnqueueWriteBuffer( hardware.queue, buffer, CL_FALSE, offset, size, hostPointer,
+				    num_events_in_wait_list, event_wait_list, &myEvent );
+	if ( err != CL_SUCCESS ) { 
+		fprintf( stderr,  "\nclWriteAsync Error\n" );
+		sclPrintErrorFlags( err );
+		return NULL;
+	}
+	_sclProfileCommand( hardware, myEvent, "sclWriteAsync", "transfer", size );
+	clFlush( hardware.queue );
+
+	return myEvent;
+}
+
+cl_event sclReadAsync( sclHard hardware, size_t offset, size_t size, cl_mem buffer, void* hostPointer,
+		       cl_uint num_events_in_wait_list, const cl_event *event_wait_list ) {
+	cl_event myEvent=NULL;
+	cl_int err;
+
+	err = clEnqueueReadBuffer( hardware.queue, buffer, CL_FALSE, offset, size, hostPointer,
+				   num_events_in_wait_list, event_wait_list, &myEvent );
+	if ( err != CL_SUCCESS ) { 
+		fprintf( stderr,  "\nclReadAsync Error\n" );
+		sclPrintErrorFlags( err );
+		return NULL;
+	}
+	_sclProfileCommand( hardware, myEvent, "sclReadAsync", "transfer", size );
+	clFlush( hardware.queue );
+
+	return myEvent;
+}
+
+cl_mem sclMallocWriteAsync( sclHard hardware, cl_int mode, size_t size, void* hostPointer, cl_event* event ) {
+	cl_mem buffer;
+
+	buffer = sclMalloc( hardware, mode, size );
+	if ( buffer == NULL ) { 
+		fprintf( stderr,  "\nclMallocWriteAsync Error on clCreateBuffer\n" );
+		*event = NULL;
+		return NULL;
+	}
+	*event = sclWriteAsync( hardware, 0, size, buffer, hostPointer, 0, NULL );
+
+	return buffer;
+}
+
+cl_int sclFinish( sclHard hardware ){
+#ifdef DEBUG
+	cl_int err;
+
+	err = clFinish( hardware.queue );
+	if ( err != CL_SUCCESS ) {
+		fprintf( stderr,  "\nError clFinish\n" );
+		sclPrintErrorFlags( err );
+	}
+#else
+	clFinish( hardware.queue );
+#endif
+
+	return err;
+
+}
+
+cl_ulong sclGetEventTime( sclHard hardware, cl_event event ){
+
+	cl_ulong elapsedTime, startTime, endTime;
+
+	sclFinish( hardware );
+
+	clGetEventProfilingInfo( event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &startTime, NULL);
+	clGetEventProfilingInfo( event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &endTime, NULL);
+
+	elapsedTime = endTime-startTime;
+
+	return elapsedTime;
+}
+
+void sclSetKernelArg( sclSoft software, int argnum, size_t typeSize, void *argument ){
+#ifdef DEBUG
+	cl_int err;
+
+	err = clSetKernelArg( software.kernel, argnum, typeSize, argument );
+	if ( err != CL_SUCCESS ) {	
+		fprintf( stderr,  "\nError clSetKernelArg number %d\n", argnum );
+		sclPrintErrorFlags( err );
+	}
+#else
+	clSetKernelArg( software.kernel, argnum, typeSize, argument );
+#endif
+
+}
+
+void _sclWriteArgOnAFile( int argnum, void* arg, size_t size, const char* diff ) {
+	FILE *out;
+	char filename[150];
+
+	sprintf( filename, "../data/arg%d%s", argnum, diff );
+
+	out = fopen( filename, "w+");
+
+	fwrite( arg, 1, size, out );
+
+	fclose(out);
+}
+
+ void _sclVSetKernelArgs( sclSoft software, const char *sizesValues, va_list argList ) {
+	const char *p;
+	int argCount = 0;
+	void* argument;
+	size_t actual_size;
+	sclBuffer* managed;
+	cl_mem buffer;
+	cl_context context = NULL;
+	
+	for( p = sizesValues; *p != '\0'; p++ ) {
+		if ( *p == '%' ) {
+			switch( *++p ) {
+				case 'a':
+					actual_size = va_arg( argList, size_t );
+					argument = va_arg( argList, void* );
+					sclSetKernelArg( software, argCount, actual_size, argument );
+					argCount++;			
+					break;
+
+				case 'v':
+					argument = va_arg( argList, void* );
+					sclSetKernelArg( software, argCount, sizeof(cl_mem) , argument );
+					argCount++;			
+					break;
+
+				case 'N':
+					actual_size = va_arg( argList, size_t );
+					sclSetKernelArg( software, argCount, actual_size, NULL );
+					argCount++;			
+					break;
+
+				case 'b':
+				case 'B':
+					managed = va_arg( argList, sclBuffer* );
+					if ( context == NULL ) {
+						clGetKernelInfo( software.kernel, CL_KERNEL_CONTEXT, sizeof(cl_context), &context, NULL );
+					}
+					if ( managed->hardware.context != context ) {
+						fprintf( stderr, "\nsclSetKernelArgs: the buffer of argument %d belongs to another context", argCount );
+						argCount++;
+						break;
+					}
+					buffer = sclBufferDevice( managed );
+					sclSetKernelArg( software, argCount, sizeof(cl_mem), &buffer );
+					if ( *p == 'B' ) {
+						sclBufferDeviceModified( managed );
+					}
+					argCount++;
+					break;
+				default:
+					break;
+
+			}
+		}
+	}
+}
+
+void sclSetKernelArgs( sclSoft software, const char *sizesValues, ... ){
+	va_list argList;
+
+	va_start( argList, sizesValues );
+
+	_sclVSetKernelArgs( software, sizesValues, argList );	
+
+	va_end( argList );
+
+}
+
+cl_event sclSetArgsLaunchKernel( sclHard hardware, sclSoft software, size_t *global_work_size, size_t *local_work_size,
+				const char *sizesValues, ... ) {
+	va_list argList;
+	cl_event event;
+
+	va_start( argList, sizesValues );
+	
+	_sclVSetKernelArgs( software, sizesValues, argList );	
+	
+	va_end( argList );
+
+	event = sclLaunchKernel( hardware, software, global_work_size, local_work_size );
+
+	return event;
+
+}
+
+cl_event sclSetArgsLaunchKernelND( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_offset,
+				   size_t *global_work_size, size_t *local_work_size, const char *sizesValues, ... ) {
+	va_list argList;
+	cl_event event;
+
+	va_start( argList, sizesValues );
+	
+	_sclVSetKernelArgs( software, sizesValues, argList );	
+	
+	va_end( argList );
+
+	event = sclLaunchKernelND( hardware, software, work_dim, global_work_offset, global_work_size, local_work_size );
+
+	return event;
+
+}
+
+cl_event sclSetArgsEnqueueKernel( sclHard hardware, sclSoft software, size_t *global_work_size, size_t *local_work_size,
+				 const char *sizesValues, ... ) {
+	va_list argList;
+	cl_event event;
+
+	va_start( argList, sizesValues );
+	
+	_sclVSetKernelArgs( software, sizesValues, argList );	
+	
+	va_end( argList );
+
+	event = sclEnqueueKernel( hardware, software, global_work_size, local_work_size );
+
+	return event;
+	
+
+}
+
+cl_event sclSetArgsEnqueueKernelND( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_offset,
+				    size_t *global_work_size, size_t *local_work_size, const char *sizesValues, ... ) {
+	va_list argList;
+	cl_event event;
+
+	va_start( argList, sizesValues );
+	
+	_sclVSetKernelArgs( software, sizesValues, argList );	
+	
+	va_end( argList );
+
+	event = sclEnqueueKernelND( hardware, software, work_dim, global_work_offset, global_work_size, local_work_size );
+
+	return event;
+
+}
+
+int _sclCheckManagedArgs( sclHard hardware, const char* sizesValues, va_list argList ) {
+	const char *p;
+	int argCount = 0;
+	sclBuffer* managed;
+
+	for( p = sizesValues; *p != '\0'; p++ ) {
+		if ( *p == '%' ) {
+			if ( *( p + 1 ) == 'z' ) {
+				p++;
+			}
+			switch( *++p ) {
+				case 'a':
+				case 'w':
+				case 'r':
+				case 'R':
+					(void)va_arg( argList, size_t );
+					(void)va_arg( argList, void* );
+					break;
+				case 'v':
+					(void)va_arg( argList, void* );
+					break;
+				case 'N':
+				case 'g':
+					(void)va_arg( argList, size_t );
+					break;
+				case 'b':
+				case 'B':
+					managed = va_arg( argList, sclBuffer* );
+					if ( managed->hardware.context != hardware.context ) {
+						fprintf( stderr, "\nsclManageArgsLaunchKernel: the buffer of argument %d belongs to another context", argCount );
+						return -1;
+					}
+					break;
+				default:
+					break;
+			}
+			argCount++;
+		}
+	}
+
+	return 0;
+}
+
+cl_event _sclVManageArgsLaunchKernel( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_offset,
+				      size_t *global_work_size, size_t *local_work_size, const char* sizesValues, va_list argList ) {
+	cl_event event;
+	const char *p;
+	int argCount = 0, outArgCount = 0, inArgCount = 0, i;
+	void* argument;
+	size_t actual_size;
+	cl_mem* outBuffs;
+	cl_mem* inBuffs;
+	size_t* sizesOut;
+	typedef unsigned char* puchar;
+	puchar* outArgs;
+	cl_event* writeEvents;
+	cl_event* readEvents;
+	int nWriteEvents = 0, nReadEvents = 0;
+	int* outZeroCopy;
+	int zeroCopy, nArgs = 1, nWritten = 0;
+	void* mapped;
+	sclBuffer* managed;
+	sclBuffer** written;
+	cl_mem deviceBuffer;
+	va_list checkList;
+
+	/* Managed buffers are checked before any upload reads the host arrays */
+	va_copy( checkList, argList );
+	i = _sclCheckManagedArgs( hardware, sizesValues, checkList );
+	va_end( checkList );
+	if ( i != 0 ) {
+		return NULL;
+	}
+
+	/* Every list is sized by the number of arguments of the format string */
+	for( p = sizesValues; *p != '\0'; p++ ) {
+		if ( *p == '%' ) { nArgs++; }
+	}
+	outBuffs    = (cl_mem*)malloc( nArgs * sizeof(cl_mem) );
+	inBuffs     = (cl_mem*)malloc( nArgs * sizeof(cl_mem) );
+	sizesOut    = (size_t*)malloc( nArgs * sizeof(size_t) );
+	outArgs     = (puchar*)malloc( nArgs * sizeof(puchar) );
+	writeEvents = (cl_event*)malloc( nArgs * sizeof(cl_event) );
+	readEvents  = (cl_event*)malloc( nArgs * sizeof(cl_event) );
+	outZeroCopy = (int*)malloc( nArgs * sizeof(int) );
+	written     = (sclBuffer**)malloc( nArgs * sizeof(sclBuffer*) );
+
+	for( p = sizesValues; *p != '\0'; p++ ) {
+		if ( *p == '%' ) {
+			/* Unified memory devices work on the host arrays without copies */
+			zeroCopy = hardware.unifiedMemory;
+			if ( *( p + 1 ) == 'z' ) {
+				zeroCopy = 1;
+				p++;
+			}
+			switch( *++p ) {
+				case 'a': /* Single value non pointer argument */
+					actual_size = va_arg( argList, size_t );
 					argument = va_arg( argList, void* );
 					sclSetKernelArg( software, argCount, actual_size, argument );
 					argCount++;			
 					break;
 
+				case 'v': /* Buffer or image object void* argument */
+					argument = va_arg( argList, void* );
+					sclSetKernelArg( software, argCount, sizeof(cl_mem) , argument );
+					argCount++;			
+					break;
+
+				case 'N': /* Local memory object using NULL argument */
+					actual_size = va_arg( argList, size_t );
+					sclSetKernelArg( software, argCount, actual_size, NULL );
+					argCount++;
+					break;
+				case 'w': /* */
+					sizesOut[ outArgCount ] = va_arg( argList, size_t );
+					outArgs[ outArgCount ] = (unsigned char*)va_arg( argList, void* );
+					outZeroCopy[ outArgCount ] = zeroCopy;
+					if ( zeroCopy ) {
+						outBuffs[ outArgCount ] = sclMallocHost( hardware, CL_MEM_WRITE_ONLY, sizesOut[ outArgCount ],
+											 _sclIsPageAligned( outArgs[ outArgCount ] ) ?
+											 outArgs[ outArgCount ] : NULL );
+					}
+					else {
+						outBuffs[ outArgCount ] = sclMalloc( hardware, CL_MEM_WRITE_ONLY,
+										     sizesOut[ outArgCount ] );
+					}
+					sclSetKernelArg( software, argCount, sizeof(cl_mem), &outBuffs[ outArgCount ] );
+					argCount++;
+					outArgCount++;
+					break;
+				case 'r': /* */
+					actual_size = va_arg( argList, size_t );
+					argument = va_arg( argList, void* );
+					if ( zeroCopy ) {
+						inBuffs[ inArgCount ] = sclMallocHost( hardware, CL_MEM_READ_ONLY, actual_size, argument );
+					}
+					else {
+						inBuffs[ inArgCount ] = sclMallocWriteAsync( hardware, CL_MEM_READ_ONLY, actual_size,
+											       argument, &writeEvents[ nWriteEvents ] );
+						if ( writeEvents[ nWriteEvents ] != NULL ) { nWriteEvents++; }
+					}
+					sclSetKernelArg( software, argCount, sizeof(cl_mem), &inBuffs[ inArgCount ] );
+					inArgCount++;
+					argCount++;
+					break;
+				case 'R': /* */
+					sizesOut[ outArgCount ] = va_arg( argList, size_t );
+					outArgs[ outArgCount ] = (unsigned char*)va_arg( argList, void* );
+					outZeroCopy[ outArgCount ] = zeroCopy;
+					if ( zeroCopy ) {
+						outBuffs[ outArgCount ] = sclMallocHost( hardware, CL_MEM_READ_WRITE, sizesOut[ outArgCount ],
+											 outArgs[ outArgCount ] );
+					}
+					else {
+						outBuffs[ outArgCount ] = sclMallocWriteAsync( hardware, CL_MEM_READ_WRITE, 
+											       sizesOut[ outArgCount ],
+											       outArgs[ outArgCount ],
+											       &writeEvents[ nWriteEvents ] );
+						if ( writeEvents[ nWriteEvents ] != NULL ) { nWriteEvents++; }
+					}
+					sclSetKernelArg( software, argCount, sizeof(cl_mem), &outBuffs[ outArgCount ] );
+					argCount++;
+					outArgCount++;
+					break;
+				case 'g':
+					actual_size = va_arg( argList, size_t );
+					inBuffs[ inArgCount ] = sclMalloc( hardware, CL_MEM_READ_WRITE, actual_size );
+					sclSetKernelArg( software, argCount, sizeof(cl_mem), &inBuffs[ inArgCount ] );
+					inArgCount++;
+					argCount++;
+					break;
+				case 'b': /* Managed buffer, uploaded only if the host copy changed */
+				case 'B': /* Same, and the kernel makes the device copy the newest */
+					managed = va_arg( argList, sclBuffer* );
+					deviceBuffer = sclBufferDevice( managed );
+					sclSetKernelArg( software, argCount, sizeof(cl_mem), &deviceBuffer );
+					if ( *p == 'B' ) {
+						written[ nWritten++ ] = managed;
+					}
+					argCount++;
+					break;
+				default:
+					break;
+			}
+		}
+	}
+	
+	/* Uploads, kernel and downloads are chained with events, the host only waits at the end */
+	event = sclEnqueueKernelAsync( hardware, software, work_dim, global_work_offset, global_work_size, local_work_size,
+				       nWriteEvents, nWriteEvents > 0 ? writeEvents : NULL );
+	
+	for ( i = 0; i < outArgCount; i++ ) {
+		if ( outZeroCopy[i] ) {
+			continue;
+		}
+		readEvents[ nReadEvents ] = sclReadAsync( hardware, 0, sizesOut[i], outBuffs[i], outArgs[i],
+							  event != NULL ? 1 : 0, event != NULL ? &event : NULL );
+		if ( readEvents[ nReadEvents ] != NULL ) { nReadEvents++; }
+	}
+
+	/* Mapping makes the results visible in the host array, it only copies when
+	   the runtime could not use the array itself */
+	for ( i = 0; i < outArgCount; i++ ) {
+		if ( !outZeroCopy[i] || outBuffs[i] == NULL ) {
+			continue;
+		}
+		mapped = _sclMapBuffer( hardware, outBuffs[i], CL_MAP_READ, 0, sizesOut[i],
+					event != NULL ? 1 : 0, event != NULL ? &event : NULL );
+		if ( mapped != NULL ) {
+			if ( mapped != (void*)outArgs[i] ) {
+				memcpy( outArgs[i], mapped, sizesOut[i] );
+			}
+			sclUnmap( hardware, outBuffs[i], mapped );
+		}
+	}
+
+	if ( nReadEvents > 0 ) {
+		sclWaitForEvents( nReadEvents, readEvents );
+	}
+	else if ( event != NULL ) {
+		sclWaitForEvents( 1, &event );
+	}
+	else {
+		sclFinish( hardware );
+	}
+
+	for ( i = 0; i < nWriteEvents; i++ ) {
+		sclReleaseEvent( writeEvents[i] );
+	}
+	for ( i = 0; i < nReadEvents; i++ ) {
+		sclReleaseEvent( readEvents[i] );
+	}
+	
+	for ( i = 0; i < outArgCount; i++ ) {
+		sclReleaseMemObject( outBuffs[i] );		
+	}
+
+	for ( i = 0; i < inArgCount; i++ ) {
+		sclReleaseMemObject( inBuffs[i] );
+	}
+
+	free( outBuffs );
+	free( inBuffs );
+	free( sizesOut );
+	free( outArgs );
+	free( writeEvents );
+	free( readEvents );
+	free( outZeroCopy );
+
+	for ( i = 0; i < nWritten; i++ ) {
+		sclBufferDeviceModified( written[i] );
+	}
+	free( written );
+
+	return event;
+}
+
+cl_event sclManageArgsLaunchKernel( sclHard hardware, sclSoft software, size_t *global_work_size, size_t *local_work_size,
+				    const char* sizesValues, ... ) {
+	va_list argList;
+	cl_event event;
+
+	va_start( argList, sizesValues );
+
+	event = _sclVManageArgsLaunchKernel( hardware, software, 2, NULL, global_work_size, local_work_size,
+					     sizesValues, argList );
+
+	va_end( argList );
+
+	return event;
+}
+
+cl_event sclManageArgsLaunchKernelND( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_offset,
+				      size_t *global_work_size, size_t *local_work_size, const char* sizesValues, ... ) {
+	va_list argList;
+	cl_event event;
+
+	va_start( argList, sizesValues );
+
+	event = _sclVManageArgsLaunchKernel( hardware, software, work_dim, global_work_offset, global_work_size,
+					     local_work_size, sizesValues, argList );
+
+	va_end( argList );
+
+	return event;
+}
+
+double _sclGetWallTime( void ) {
+	struct timeval tv;
+
+	gettimeofday( &tv, NULL );
+
+	return (double)tv.tv_sec + (double)tv.tv_usec * 1e-6;
+}
+
+int _sclParseArgs( const char* sizesValues, va_list argList, _sclArgSpec** args ) {
+	const char *p;
+	int nArgs = 0;
+
+	for( p = sizesValues; *p != '\0'; p++ ) {
+		if ( *p == '%' ) { nArgs++; }
+	}
+	*args = (_sclArgSpec*)calloc( nArgs > 0 ? nArgs : 1, sizeof(_sclArgSpec) );
+	nArgs = 0;
+
+	for( p = sizesValues; *p != '\0'; p++ ) {
+		if ( *p == '%' ) {
+			if ( *( p + 1 ) == 'z' ) { /* Zero-copy hint, the buffers are managed here */
+				p++;
+			}
+			if ( *( p + 1 ) == 'p' ) { /* Partitioned among devices */
+				(*args)[ nArgs ].partitioned = 1;
+				p++;
+			}
+			(*args)[ nArgs ].kind = *++p;
+			switch( *p ) {
+				case 'a': /* Value: size and pointer */
+				case 'r': /* Host pointers: size (or element size) and pointer */
+				case 'w':
+				case 'R':
+					(*args)[ nArgs ].size    = va_arg( argList, size_t );
+					(*args)[ nArgs ].pointer = va_arg( argList, void* );
+					break;
+				case 'v': /* cl_mem pointer */
+					(*args)[ nArgs ].size    = sizeof(cl_mem);
+					(*args)[ nArgs ].pointer = va_arg( argList, void* );
+					break;
+				case 'N': /* Sizes only */
+				case 'g':
+					(*args)[ nArgs ].size    = va_arg( argList, size_t );
+					break;
+				case 'n': /* Filled in by the library */
+				case 'o':
+					(*args)[ nArgs ].size    = sizeof(cl_uint);
+					break;
+				case 'b': /* Managed buffers live on one device */
+				case 'B':
+					fprintf( stderr, "\nArgument format %%%c is only valid for a single device launch", *p );
+					free( *args );
+					*args = NULL;
+					return -1;
+				default: /* The values of the next arguments can not be found */
+					fprintf( stderr, "\nUnknown argument format %%%c", *p );
+					free( *args );
+					*args = NULL;
+					return -1;
+			}
+			nArgs++;
+		}
+	}
+
+	return nArgs;
+}
+
+void _sclStreamCopyOut( _sclArgSpec* args, int nArgs, void** staging, size_t start, size_t count ) {
+	int i;
+
+	for ( i = 0; i < nArgs; ++i ) {
+		if ( staging[i] != NULL && ( args[i].kind == 'w' || args[i].kind == 'R' ) ) {
+			memcpy( (unsigned char*)args[i].pointer + start * args[i].size, staging[i], count * args[i].size );
+		}
+	}
+}
+
+/* Streaming execution. The host arrays are processed in chunks of chunkItems
+   work-items. Every slot has its own queue and device buffers, so the upload of
+   a chunk, the kernel of the previous one and the download of the one before
+   that can run at the same time. */
+
+sclStreamStats sclStreamLaunchKernel( sclHard hardware, sclSoft software, size_t nItems, size_t chunkItems, int nSlots,
+				      size_t *local_work_size, const char* sizesValues, ... ) {
+	va_list argList;
+	sclStreamStats stats;
+	_sclArgSpec *args;
+	cl_command_queue *queues;
+	cl_mem *buffers;
+	cl_event *lastEvents, event, kernelEvent;
+	sclHard slotHard;
+	void **staging;
+	size_t *slotStart, *slotCount;
+	size_t start, count, global, local = 0, itemBytes = 0, offset, maxChunkItems;
+	cl_uint chunkCount;
+	cl_int err;
+	int nArgs, i, slot;
+	double startTime;
+
+	memset( &stats, 0, sizeof(stats) );
+
+	va_start( argList, sizesValues );
+	nArgs = _sclParseArgs( sizesValues, argList, &args );
+	va_end( argList );
+	if ( nArgs < 0 ) {
+		return stats;
+	}
+
+	if ( nSlots < 2 ) {
+		nSlots = 3;
+	}
+	if ( local_work_size != NULL ) {
+		local = local_work_size[0];
+	}
+
+	for ( i = 0; i < nArgs; ++i ) {
+		if ( args[i].kind == 'r' || args[i].kind == 'w' || args[i].kind == 'R' || args[i].kind == 'g' ) {
+			itemBytes += args[i].size;
+		}
+	}
+	if ( chunkItems == 0 ) {
+		/* About 16MB of device memory per slot */
+		chunkItems = itemBytes > 0 ? ( 16 * 1024 * 1024 ) / itemBytes : nItems;
+	}
+	for ( i = 0; i < nArgs; ++i ) {
+		if ( args[i].size > 0 && chunkItems * args[i].size > hardware.maxPointerSize &&
+				args[i].kind != 'a' && args[i].kind != 'v' && args[i].kind != 'N' ) {
+			chunkItems = hardware.maxPointerSize / args[i].size;
+		}
+	}
+	maxChunkItems = chunkItems;
+	if ( chunkItems > nItems ) {
+		chunkItems = nItems;
+	}
+	if ( local > 0 ) {
+		chunkItems = ( chunkItems + local - 1 ) / local * local;
+		/* Rounding up must not go past the biggest buffer the device can allocate */
+		if ( chunkItems > maxChunkItems ) {
+			chunkItems = maxChunkItems / local * local;
+			if ( chunkItems == 0 ) {
+				chunkItems = local;
+			}
+		}
+	}
+	if ( chunkItems == 0 ) {
+		free( args );
+		return stats;
+	}
+
+	queues     = (cl_command_queue*)malloc( nSlots * sizeof(cl_command_queue) );
+	lastEvents = (cl_event*)calloc( nSlots, sizeof(cl_event) );
+	buffers    = (cl_mem*)calloc( nSlots * nArgs, sizeof(cl_mem) );
+	staging    = (void**)calloc( nSlots * nArgs, sizeof(void*) );
+	slotStart  = (size_t*)calloc( nSlots, sizeof(size_t) );
+	slotCount  = (size_t*)calloc( nSlots, sizeof(size_t) );
+
+	for ( slot = 0; slot < nSlots; ++slot ) {
+		queues[ slot ] = clCreateCommandQueue( hardware.context, hardware.device, CL_QUEUE_PROFILING_ENABLE, &err );
+		if ( err != CL_SUCCESS ) {
+			fprintf( stderr, "\nError creating stream queue %d", slot );
+			sclPrintErrorFlags( err );
+			queues[ slot ] = hardware.queue;
+			clRetainCommandQueue( hardware.queue );
+		}
+		for ( i = 0; i < nArgs; ++i ) {
+			switch ( args[i].kind ) {
+				case 'r': buffers[ slot * nArgs + i ] = sclMalloc( hardware, CL_MEM_READ_ONLY, chunkItems * args[i].size ); break;
+				case 'w': buffers[ slot * nArgs + i ] = sclMalloc( hardware, CL_MEM_WRITE_ONLY, chunkItems * args[i].size ); break;
+				case 'R':
+				case 'g': buffers[ slot * nArgs + i ] = sclMalloc( hardware, CL_MEM_READ_WRITE, chunkItems * args[i].size ); break;
+				default: break;
+			}
+			/* Host arrays that are not pinned go through a pinned chunk, so the
+			   transfers of a slot really run while the host fills the next one */
+			if ( ( args[i].kind == 'r' || args[i].kind == 'w' || args[i].kind == 'R' ) &&
+					!_sclIsHostAllocated( args[i].pointer, nItems * args[i].size ) ) {
+				staging[ slot * nArgs + i ] = sclHostAlloc( hardware, chunkItems * args[i].size );
+			}
+		}
+	}
+
+	startTime = _sclGetWallTime();
+	slotHard = hardware;
+
+	for ( start = 0; start < nItems; start += chunkItems ) {
+		slot  = (int)( stats.chunks % nSlots );
+		count = nItems - start < chunkItems ? nItems - start : chunkItems;
+		slotHard.queue = queues[ slot ];
+
+		/* The slot buffers are free once the last command of the slot is done */
+		if ( lastEvents[ slot ] != NULL ) {
+			sclWaitForEvents( 1, &lastEvents[ slot ] );
+			sclReleaseEvent( lastEvents[ slot ] );
+			lastEvents[ slot ] = NULL;
+			_sclStreamCopyOut( args, nArgs, &staging[ slot * nArgs ], slotStart[ slot ], slotCount[ slot ] );
+		}
+
+		for ( i = 0; i < nArgs; ++i ) {
+			offset = start * args[i].size;
+			switch ( args[i].kind ) {
+				case 'a':
+					sclSetKernelArg( software, i, args[i].size, args[i].pointer );
+					break;
+				case 'v':
+					sclSetKernelArg( software, i, sizeof(cl_mem), args[i].pointer );
+					break;
+				case 'N':
+					sclSetKernelArg( software, i, args[i].size, NULL );
+					break;
+				case 'n':
+					chunkCount = (cl_uint)count;
+					sclSetKernelArg( software, i, sizeof(cl_uint), &chunkCount );
+					break;
+				case 'r':
+				case 'R':
+					if ( staging[ slot * nArgs + i ] != NULL ) {
+						memcpy( staging[ slot * nArgs + i ], (unsigned char*)args[i].pointer + offset,
+							count * args[i].size );
+					}
+					event = sclWriteAsync( slotHard, 0, count * args[i].size, buffers[ slot * nArgs + i ],
+							       staging[ slot * nArgs + i ] != NULL ? staging[ slot * nArgs + i ] :
+							       (unsigned char*)args[i].pointer + offset, 0, NULL );
+					sclReleaseEvent( event );
+					stats.bytesIn += count * args[i].size;
+					sclSetKernelArg( software, i, sizeof(cl_mem), &buffers[ slot * nArgs + i ] );
+					break;
+				default:
+					sclSetKernelArg( software, i, sizeof(cl_mem), &buffers[ slot * nArgs + i ] );
+					break;
+			}
+		}
+
+		global = local > 0 ? ( count + local - 1 ) / local * local : count;
+		kernelEvent = sclEnqueueKernelAsync( slotHard, software, 1, NULL, &global, local > 0 ? &local : NULL, 0, NULL );
+
+		for ( i = 0; i < nArgs; ++i ) {
+			if ( args[i].kind == 'w' || args[i].kind == 'R' ) {
+				event = sclReadAsync( slotHard, 0, count * args[i].size, buffers[ slot * nArgs + i ],
+						      staging[ slot * nArgs + i ] != NULL ? staging[ slot * nArgs + i ] :
+						      (unsigned char*)args[i].pointer + start * args[i].size, 0, NULL );
+				stats.bytesOut += count * args[i].size;
+				if ( event != NULL ) {
+					sclReleaseEvent( kernelEvent );
+					kernelEvent = event;
+				}
+			}
+		}
+		/* In order queue: the last command of the chunk tells when the whole slot is free */
+		lastEvents[ slot ] = kernelEvent;
+		slotStart[ slot ] = start;
+		slotCount[ slot ] = count;
+		stats.chunks++;
+	}
+
+	for ( slot = 0; slot < nSlots; ++slot ) {
+		clFinish( queues[ slot ] );
+		sclReleaseEvent( lastEvents[ slot ] );
+		_sclStreamCopyOut( args, nArgs, &staging[ slot * nArgs ], slotStart[ slot ], slotCount[ slot ] );
+	}
+	stats.seconds = _sclGetWallTime() - startTime;
+	stats.throughput = stats.seconds > 0.0 ? (double)( stats.bytesIn + stats.bytesOut ) / stats.seconds * 1e-9 : 0.0;
+
+	for ( slot = 0; slot < nSlots; ++slot ) {
+		for ( i = 0; i < nArgs; ++i ) {
+			if ( buffers[ slot * nArgs + i ] != NULL ) {
+				sclReleaseMemObject( buffers[ slot * nArgs + i ] );
+			}
+			sclHostFree( staging[ slot * nArgs + i ] );
+		}
+		clReleaseCommandQueue( queues[ slot ] );
+	}
+
+	free( slotCount );
+	free( slotStart );
+	free( staging );
+	free( buffers );
+	free( lastEvents );
+	free( queues );
+	free( args );
+
+	return stats;
+}
+
+/* Measured throughput, in work-items per second, of every kernel on every
+   device. sclManageArgsLaunchKernelMulti splits the NDRange with it. */
+
+typedef struct {
+	char kernelName[98];
+	int devNum;
+	double itemsPerSecond;
+} _sclDeviceRate;
+
+static _sclDeviceRate* _sclRateList = NULL;
+static int _sclRateListLength = 0;
+
+double _sclGetDeviceRate( const char* kernelName, int devNum ) {
+	int i;
+
+	for ( i = 0; i < _sclRateListLength; ++i ) {
+		if ( _sclRateList[i].devNum == devNum && strcmp( _sclRateList[i].kernelName, kernelName ) == 0 ) {
+			return _sclRateList[i].itemsPerSecond;
+		}
+	}
+
+	return 0.0;
+}
+
+void _sclUpdateDeviceRate( const char* kernelName, int devNum, double itemsPerSecond ) {
+	int i;
+
+	for ( i = 0; i < _sclRateListLength; ++i ) {
+		if ( _sclRateList[i].devNum == devNum && strcmp( _sclRateList[i].kernelName, kernelName ) == 0 ) {
+			/* Smooth the noise of single runs */
+			_sclRateList[i].itemsPerSecond = 0.5 * _sclRateList[i].itemsPerSecond + 0.5 * itemsPerSecond;
+			return;
+		}
+	}
+
+	_sclRateList = (_sclDeviceRate*)realloc( _sclRateList, ( _sclRateListLength + 1 ) * sizeof(_sclDeviceRate) );
+	snprintf( _sclRateList[ _sclRateListLength ].kernelName, sizeof(_sclRateList[0].kernelName), "%s", kernelName );
+	_sclRateList[ _sclRateListLength ].devNum = devNum;
+	_sclRateList[ _sclRateListLength ].itemsPerSecond = itemsPerSecond;
+	_sclRateListLength++;
+}
+
+double sclGetDeviceRate( sclHard hardware, sclSoft software ) {
+	return _sclGetDeviceRate( software.kernelName, hardware.devNum );
+}
+
+cl_ulong _sclGetEventSpan( cl_event* events, int nEvents ) {
+	cl_ulong start, end, first = 0, last = 0;
+	int i;
+
+	for ( i = 0; i < nEvents; ++i ) {
+		if ( clGetEventProfilingInfo( events[i], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL ) != CL_SUCCESS ||
+				clGetEventProfilingInfo( events[i], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL ) != CL_SUCCESS ) {
+			return 0;
+		}
+		if ( i == 0 || start < first ) { first = start; }
+		if ( i == 0 || end > last )    { last = end; }
+	}
+
+	return last > first ? last - first : 0;
+}
+
+/* Multi-device managed launch. The last dimension of the NDRange is split among
+   the devices proportionally to their measured throughput for this kernel (the
+   first launch splits evenly). Arguments marked with %p (%pr, %pw, %pR, %pg)
+   are split with it, the rest are broadcast to every device. Every device sees
+   its part as an NDRange starting at 0, and %o sets a cl_uint argument with the
+   first index of the part in the whole range. */
+
+int sclManageArgsLaunchKernelMulti( sclHard* hardList, sclSoft* softList, int found, cl_uint work_dim,
+				    size_t *global_work_size, size_t *local_work_size, const char* sizesValues, ... ) {
+	va_list argList;
+	_sclArgSpec *args;
+	cl_mem *buffers;
+	cl_event *events, kernelEvent;
+	int *nEvents;
+	size_t *parts, *starts;
+	size_t units, unitItems, assigned, length, rowBytes, offset, bytes;
+	size_t global[3];
+	double *rates, totalRate = 0.0;
+	cl_ulong span;
+	cl_uint startIndex;
+	int nArgs, i, d, used = 0, fastest = 0, unknown = 0;
+	cl_uint split = work_dim - 1;
+
+	va_start( argList, sizesValues );
+	nArgs = _sclParseArgs( sizesValues, argList, &args );
+	va_end( argList );
+	if ( nArgs < 0 ) {
+		return 0;
+	}
+
+	for ( i = 0; i < nArgs; ++i ) {
+		if ( ( args[i].kind == 'w' || args[i].kind == 'R' ) && !args[i].partitioned ) {
+			fprintf( stderr, "\nsclManageArgsLaunchKernelMulti: output argument %d must be partitioned (%%p%c)", i, args[i].kind );
+			free( args );
+			return 0;
+		}
+	}
+	if ( found < 1 || work_dim < 1 || work_dim > 3 ) {
+		free( args );
+		return 0;
+	}
+
+	/* Split the last dimension in units of the work-group size */
+	length    = global_work_size[ split ];
+	unitItems = local_work_size != NULL ? local_work_size[ split ] : 1;
+	if ( length == 0 || unitItems == 0 || length % unitItems != 0 ) {
+		fprintf( stderr, "\nsclManageArgsLaunchKernelMulti: global size %lu is not a multiple of the local size %lu",
+			 (unsigned long)length, (unsigned long)unitItems );
+		free( args );
+		return 0;
+	}
+	units     = length / unitItems;
+
+	/* Partitioned arrays are split in rows, one per index of the last dimension */
+	for ( i = 0; i < nArgs; ++i ) {
+		if ( args[i].partitioned && args[i].size % length != 0 ) {
+			fprintf( stderr, "\nsclManageArgsLaunchKernelMulti: size of argument %d (%lu) is not a multiple of %lu rows",
+				 i, (unsigned long)args[i].size, (unsigned long)length );
+			free( args );
+			return 0;
+		}
+	}
+
+	rates  = (double*)malloc( found * sizeof(double) );
+	parts  = (size_t*)calloc( found, sizeof(size_t) );
+	starts = (size_t*)calloc( found, sizeof(size_t) );
+	for ( d = 0; d < found; ++d ) {
+		rates[d] = _sclGetDeviceRate( softList[d].kernelName, hardList[d].devNum );
+		if ( rates[d] <= 0.0 ) { unknown = 1; }
+	}
+	for ( d = 0; d < found; ++d ) {
+		if ( unknown ) { rates[d] = 1.0; }
+		totalRate += rates[d];
+		if ( rates[d] > rates[ fastest ] ) { fastest = d; }
+	}
+	assigned = 0;
+	for ( d = 0; d < found; ++d ) {
+		parts[d] = (size_t)( (double)units * rates[d] / totalRate );
+		assigned += parts[d];
+	}
+	parts[ fastest ] += units - assigned;
+	for ( d = 0, assigned = 0; d < found; ++d ) {
+		parts[d]  *= unitItems;
+		starts[d]  = assigned;
+		assigned  += parts[d];
+	}
+
+	buffers = (cl_mem*)calloc( found * nArgs, sizeof(cl_mem) );
+	events  = (cl_event*)calloc( found * ( 2 * nArgs + 1 ), sizeof(cl_event) );
+	nEvents = (int*)calloc( found, sizeof(int) );
+
+	for ( d = 0; d < found; ++d ) {
+		if ( parts[d] == 0 ) {
+			continue;
+		}
+		for ( i = 0; i < nArgs; ++i ) {
+			rowBytes = args[i].size / length;
+			bytes    = args[i].partitioned ? parts[d] * rowBytes : args[i].size;
+			offset   = args[i].partitioned ? starts[d] * rowBytes : 0;
+			switch ( args[i].kind ) {
+				case 'a':
+					sclSetKernelArg( softList[d], i, args[i].size, args[i].pointer );
+					break;
 				case 'v':
-					argument = va_arg( argList, void* );
-					sclSetKernelArg( software, argCount, sizeof(cl_mem) , argument );
-					argCount++;			
+					sclSetKernelArg( softList[d], i, sizeof(cl_mem), args[i].pointer );
 					break;
-
 				case 'N':
-					actual_size = va_arg( argList, size_t );
-					sclSetKernelArg( software, argCount, actual_size, NULL );
-					argCount++;			
+					sclSetKernelArg( softList[d], i, args[i].size, NULL );
+					break;
+				case 'o':
+				case 'n':
+					startIndex = (cl_uint)( args[i].kind == 'o' ? starts[d] : parts[d] );
+					sclSetKernelArg( softList[d], i, sizeof(cl_uint), &startIndex );
+					break;
+				case 'r':
+				case 'R':
+					buffers[ d * nArgs + i ] = sclMalloc( hardList[d], args[i].kind == 'r' ? CL_MEM_READ_ONLY : CL_MEM_READ_WRITE, bytes );
+					kernelEvent = sclWriteAsync( hardList[d], 0, bytes, buffers[ d * nArgs + i ],
+								     (unsigned char*)args[i].pointer + offset, 0, NULL );
+					if ( kernelEvent != NULL ) { events[ d * ( 2 * nArgs + 1 ) + nEvents[d]++ ] = kernelEvent; }
+					sclSetKernelArg( softList[d], i, sizeof(cl_mem), &buffers[ d * nArgs + i ] );
+					break;
+				case 'w':
+				case 'g':
+					buffers[ d * nArgs + i ] = sclMalloc( hardList[d], args[i].kind == 'w' ? CL_MEM_WRITE_ONLY : CL_MEM_READ_WRITE, bytes );
+					sclSetKernelArg( softList[d], i, sizeof(cl_mem), &buffers[ d * nArgs + i ] );
 					break;
 				default:
 					break;
+			}
+		}
 
+		memcpy( global, global_work_size, work_dim * sizeof(size_t) );
+		global[ split ] = parts[d];
+		kernelEvent = sclEnqueueKernelAsync( hardList[d], softList[d], work_dim, NULL, global, local_work_size, 0, NULL );
+		if ( kernelEvent != NULL ) { events[ d * ( 2 * nArgs + 1 ) + nEvents[d]++ ] = kernelEvent; }
+
+		for ( i = 0; i < nArgs; ++i ) {
+			if ( args[i].kind == 'w' || args[i].kind == 'R' ) {
+				rowBytes = args[i].size / length;
+				kernelEvent = sclReadAsync( hardList[d], 0, parts[d] * rowBytes, buffers[ d * nArgs + i ],
+							    (unsigned char*)args[i].pointer + starts[d] * rowBytes, 0, NULL );
+				if ( kernelEvent != NULL ) { events[ d * ( 2 * nArgs + 1 ) + nEvents[d]++ ] = kernelEvent; }
 			}
 		}
+		used++;
 	}
-}
 
-void sclSetKernelArgs( sclSoft software, const char *sizesValues, ... ){
-	va_list argList;
+	for ( d = 0; d < found; ++d ) {
+		if ( parts[d] == 0 ) {
+			continue;
+		}
+		sclWaitForEvents( nEvents[d], &events[ d * ( 2 * nArgs + 1 ) ] );
 
-	va_start( argList, sizesValues );
+		/* Everything the device did for its part counts, transfers included */
+		span = _sclGetEventSpan( &events[ d * ( 2 * nArgs + 1 ) ], nEvents[d] );
+		if ( span > 0 ) {
+			_sclUpdateDeviceRate( softList[d].kernelName, hardList[d].devNum, (double)parts[d] * 1e9 / (double)span );
+		}
 
-	_sclVSetKernelArgs( software, sizesValues, argList );	
+		for ( i = 0; i < nEvents[d]; ++i ) {
+			sclReleaseEvent( events[ d * ( 2 * nArgs + 1 ) + i ] );
+		}
+		for ( i = 0; i < nArgs; ++i ) {
+			if ( buffers[ d * nArgs + i ] != NULL ) {
+				sclReleaseMemObject( buffers[ d * nArgs + i ] );
+			}
+		}
+	}
 
-	va_end( argList );
+	free( nEvents );
+	free( events );
+	free( buffers );
+	free( starts );
+	free( parts );
+	free( rates );
+	free( args );
 
+	return used;
 }
 
-cl_event sclSetArgsLaunchKernel( sclHard hardware, sclSoft software, size_t *global_work_size, size_t *local_work_size,
-				const char *sizesValues, ... ) {
-	va_list argList;
-	cl_event event;
+/* Work-stealing scheduler. The range is cut in many chunks and one host thread
+   per device takes the next free chunk from a shared counter until none is
+   left, so faster devices simply process more chunks. Every device holds a
+   full copy of the partitioned arrays and works on each chunk through
+   sub-buffers, that are also used to read the results back. */
 
-	va_start( argList, sizesValues );
-	
-	_sclVSetKernelArgs( software, sizesValues, argList );	
-	
-	va_end( argList );
+typedef struct {
+	sclHard hardware;
+	sclSoft software;
+	_sclArgSpec* args;
+	int nArgs;
+	cl_mem* buffers;
+	size_t nItems;
+	size_t chunkItems;
+	size_t nChunks;
+	size_t local;
+	size_t* nextChunk;
+	int chunkCount;
+} _sclWorker;
+
+cl_uint _sclGetMemBaseAddrAlign( cl_device_id device ) {
+	cl_uint align = 0;
+
+	clGetDeviceInfo( device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint), &align, NULL );
+
+	/* The device reports bits */
+	return align >= 8 ? align / 8 : 1;
+}
 
-	event = sclLaunchKernel( hardware, software, global_work_size, local_work_size );
+size_t _sclGreatestCommonDivisor( size_t a, size_t b ) {
+	size_t t;
 
-	return event;
+	while ( b != 0 ) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
 
+	return a;
 }
 
-cl_event sclSetArgsEnqueueKernel( sclHard hardware, sclSoft software, size_t *global_work_size, size_t *local_work_size,
-				 const char *sizesValues, ... ) {
-	va_list argList;
-	cl_event event;
+void* _sclWorkerThread( void* data ) {
+	_sclWorker* worker = (_sclWorker*)data;
+	cl_mem *subBuffers;
+	cl_event *events;
+	cl_buffer_region region;
+	size_t chunk, start, count, padded;
+	cl_uint value;
+	cl_int err;
+	int i, nEvents;
 
-	va_start( argList, sizesValues );
-	
-	_sclVSetKernelArgs( software, sizesValues, argList );	
-	
-	va_end( argList );
+	subBuffers = (cl_mem*)calloc( worker->nArgs, sizeof(cl_mem) );
+	events     = (cl_event*)calloc( worker->nArgs + 1, sizeof(cl_event) );
 
-	event = sclEnqueueKernel( hardware, software, global_work_size, local_work_size );
+	for ( ;; ) {
+		chunk = __sync_fetch_and_add( worker->nextChunk, 1 );
+		if ( chunk >= worker->nChunks ) {
+			break;
+		}
+		start  = chunk * worker->chunkItems;
+		count  = worker->nItems - start < worker->chunkItems ? worker->nItems - start : worker->chunkItems;
+		padded = worker->local > 0 ? ( count + worker->local - 1 ) / worker->local * worker->local : count;
 
-	return event;
-	
+		for ( i = 0; i < worker->nArgs; ++i ) {
+			if ( !worker->args[i].partitioned ) {
+				continue;
+			}
+			if ( worker->args[i].kind == 'r' || worker->args[i].kind == 'R' ) {
+				events[0] = sclWriteAsync( worker->hardware, start * worker->args[i].size, count * worker->args[i].size,
+							   worker->buffers[i], (unsigned char*)worker->args[i].pointer + start * worker->args[i].size,
+							   0, NULL );
+				sclReleaseEvent( events[0] );
+			}
+			region.origin = start * worker->args[i].size;
+			region.size   = padded * worker->args[i].size;
+			subBuffers[i] = clCreateSubBuffer( worker->buffers[i], 0, CL_BUFFER_CREATE_TYPE_REGION, &region, &err );
+			if ( err != CL_SUCCESS ) {
+				fprintf( stderr, "\nError creating sub-buffer for argument %d", i );
+				sclPrintErrorFlags( err );
+			}
+			sclSetKernelArg( worker->software, i, sizeof(cl_mem), &subBuffers[i] );
+		}
+		for ( i = 0; i < worker->nArgs; ++i ) {
+			if ( worker->args[i].kind == 'o' || worker->args[i].kind == 'n' ) {
+				value = (cl_uint)( worker->args[i].kind == 'o' ? start : count );
+				sclSetKernelArg( worker->software, i, sizeof(cl_uint), &value );
+			}
+		}
+
+		nEvents = 0;
+		events[ nEvents ] = sclEnqueueKernelAsync( worker->hardware, worker->software, 1, NULL, &padded,
+							   worker->local > 0 ? &worker->local : NULL, 0, NULL );
+		if ( events[ nEvents ] != NULL ) { nEvents++; }
+
+		for ( i = 0; i < worker->nArgs; ++i ) {
+			if ( worker->args[i].partitioned && ( worker->args[i].kind == 'w' || worker->args[i].kind == 'R' ) ) {
+				events[ nEvents ] = sclReadAsync( worker->hardware, 0, count * worker->args[i].size, subBuffers[i],
+								  (unsigned char*)worker->args[i].pointer + start * worker->args[i].size,
+								  0, NULL );
+				if ( events[ nEvents ] != NULL ) { nEvents++; }
+			}
+		}
+		if ( nEvents > 0 ) {
+			sclWaitForEvents( nEvents, events );
+		}
+		for ( i = 0; i < nEvents; ++i ) {
+			sclReleaseEvent( events[i] );
+		}
+		for ( i = 0; i < worker->nArgs; ++i ) {
+			if ( subBuffers[i] != NULL ) {
+				clReleaseMemObject( subBuffers[i] );
+				subBuffers[i] = NULL;
+			}
+		}
+		worker->chunkCount++;
+	}
+
+	free( events );
+	free( subBuffers );
 
+	return NULL;
 }
 
-cl_event sclManageArgsLaunchKernel( sclHard hardware, sclSoft software, size_t *global_work_size, size_t *local_work_size,
-				    const char* sizesValues, ... ) {
+size_t sclScheduleKernel( sclHard* hardList, sclSoft* softList, int found, size_t nItems, size_t chunkItems,
+			  size_t *local_work_size, int* chunkCounts, const char* sizesValues, ... ) {
 	va_list argList;
-	cl_event event;
-	const char *p;
-	int argCount = 0, outArgCount = 0, inArgCount = 0, i;
-	void* argument;
-	size_t actual_size;
-	cl_mem outBuffs[30];
-	cl_mem inBuffs[30];
-	size_t sizesOut[30];
-	typedef unsigned char* puchar;
-	puchar outArgs[30];
+	_sclArgSpec *args;
+	_sclWorker *workers;
+	pthread_t *threads;
+	size_t nextChunk = 0;
+	size_t local = 0, multiple = 1, itemMultiple, align = 1, nChunks, padded;
+	cl_int err;
+	int nArgs, i, d, e, running = 0, *started;
 
 	va_start( argList, sizesValues );
+	nArgs = _sclParseArgs( sizesValues, argList, &args );
+	va_end( argList );
+	if ( nArgs < 0 ) {
+		return 0;
+	}
 
-	for( p = sizesValues; *p != '\0'; p++ ) {
-		if ( *p == '%' ) {
-			switch( *++p ) {
-				case 'a': /* Single value non pointer argument */
-					actual_size = va_arg( argList, size_t );
-					argument = va_arg( argList, void* );
-					sclSetKernelArg( software, argCount, actual_size, argument );
-					argCount++;			
-					break;
-
-				case 'v': /* Buffer or image object void* argument */
-					argument = va_arg( argList, void* );
-					sclSetKernelArg( software, argCount, sizeof(cl_mem) , argument );
-					argCount++;			
-					break;
+	for ( i = 0; i < nArgs; ++i ) {
+		if ( ( args[i].kind == 'w' || args[i].kind == 'R' ) && !args[i].partitioned ) {
+			fprintf( stderr, "\nsclScheduleKernel: output argument %d must be partitioned (%%p%c)", i, args[i].kind );
+			free( args );
+			return 0;
+		}
+	}
+	if ( found < 1 || nItems == 0 ) {
+		free( args );
+		return 0;
+	}
+	/* The workers set the arguments of their kernel for every chunk */
+	for ( d = 0; d < found; ++d ) {
+		for ( e = 0; e < d; ++e ) {
+			if ( softList[d].kernel == softList[e].kernel ) {
+				fprintf( stderr, "\nsclScheduleKernel: devices %d and %d use the same kernel object", e, d );
+				free( args );
+				return 0;
+			}
+		}
+	}
+	if ( local_work_size != NULL ) {
+		local = local_work_size[0];
+		multiple = local;
+	}
 
-				case 'N': /* Local memory object using NULL argument */
-					actual_size = va_arg( argList, size_t );
-					sclSetKernelArg( software, argCount, actual_size, NULL );
-					argCount++;
-					break;
-				case 'w': /* */
-					sizesOut[ outArgCount ] = va_arg( argList, size_t );
-					outArgs[ outArgCount ] = (unsigned char*)va_arg( argList, void* );
-					outBuffs[ outArgCount ] = sclMalloc( hardware, CL_MEM_WRITE_ONLY,
-									     sizesOut[ outArgCount ] );
-					sclSetKernelArg( software, argCount, sizeof(cl_mem), &outBuffs[ outArgCount ] );
-					argCount++;
-					outArgCount++;
+	/* Chunk origins must respect the sub-buffer alignment of every device */
+	for ( d = 0; d < found; ++d ) {
+		if ( _sclGetMemBaseAddrAlign( hardList[d].device ) > align ) {
+			align = _sclGetMemBaseAddrAlign( hardList[d].device );
+		}
+	}
+	for ( i = 0; i < nArgs; ++i ) {
+		if ( args[i].partitioned && args[i].size > 0 ) {
+			args[i].size /= nItems; /* Whole array size to bytes per item */
+			itemMultiple = align / _sclGreatestCommonDivisor( align, args[i].size );
+			multiple = multiple / _sclGreatestCommonDivisor( multiple, itemMultiple ) * itemMultiple;
+		}
+	}
+	if ( chunkItems == 0 ) {
+		/* Enough chunks for the devices to balance the end of the range */
+		chunkItems = nItems / ( 16 * found );
+	}
+	chunkItems = ( chunkItems + multiple - 1 ) / multiple * multiple;
+	if ( chunkItems == 0 ) {
+		chunkItems = multiple;
+	}
+	nChunks = ( nItems + chunkItems - 1 ) / chunkItems;
+	padded  = nChunks * chunkItems;
+
+	workers = (_sclWorker*)calloc( found, sizeof(_sclWorker) );
+	threads = (pthread_t*)malloc( found * sizeof(pthread_t) );
+	started = (int*)calloc( found, sizeof(int) );
+
+	for ( d = 0; d < found; ++d ) {
+		workers[d].hardware   = hardList[d];
+		workers[d].software   = softList[d];
+		workers[d].args       = args;
+		workers[d].nArgs      = nArgs;
+		workers[d].nItems     = nItems;
+		workers[d].chunkItems = chunkItems;
+		workers[d].nChunks    = nChunks;
+		workers[d].local      = local;
+		workers[d].nextChunk  = &nextChunk;
+		workers[d].buffers    = (cl_mem*)calloc( nArgs > 0 ? nArgs : 1, sizeof(cl_mem) );
+
+		/* Broadcast arguments are set once, partitioned ones per chunk */
+		for ( i = 0; i < nArgs; ++i ) {
+			switch ( args[i].kind ) {
+				case 'a':
+					sclSetKernelArg( softList[d], i, args[i].size, args[i].pointer );
 					break;
-				case 'r': /* */
-					actual_size = va_arg( argList, size_t );
-					argument = va_arg( argList, void* );
-					inBuffs[ inArgCount ] = sclMallocWrite( hardware, CL_MEM_READ_ONLY, actual_size,
-										  argument );
-					sclSetKernelArg( software, argCount, sizeof(cl_mem), &inBuffs[ inArgCount ] );
-					inArgCount++;
-					argCount++;
+				case 'v':
+					sclSetKernelArg( softList[d], i, sizeof(cl_mem), args[i].pointer );
 					break;
-				case 'R': /* */
-					sizesOut[ outArgCount ] = va_arg( argList, size_t );
-					outArgs[ outArgCount ] = (unsigned char*)va_arg( argList, void* );
-					outBuffs[ outArgCount ] = sclMallocWrite( hardware, CL_MEM_READ_WRITE, 
-										  sizesOut[ outArgCount ],
-										  outArgs[ outArgCount ] );
-					sclSetKernelArg( software, argCount, sizeof(cl_mem), &outBuffs[ outArgCount ] );
-					argCount++;
-					outArgCount++;
+				case 'N':
+					sclSetKernelArg( softList[d], i, args[i].size, NULL );
 					break;
+				case 'r':
+				case 'R':
+				case 'w':
 				case 'g':
-					actual_size = va_arg( argList, size_t );
-					inBuffs[ inArgCount ] = sclMalloc( hardware, CL_MEM_READ_WRITE, actual_size );
-					sclSetKernelArg( software, argCount, sizeof(cl_mem), &inBuffs[ inArgCount ] );
-					inArgCount++;
-					argCount++;
+					if ( args[i].partitioned ) {
+						workers[d].buffers[i] = _sclCreateBuffer( hardList[d], CL_MEM_READ_WRITE, padded * args[i].size, &err );
+						if ( err != CL_SUCCESS ) {
+							fprintf( stderr, "\nsclScheduleKernel: error allocating argument %d", i );
+							sclPrintErrorFlags( err );
+						}
+					}
+					else if ( args[i].kind == 'r' ) {
+						workers[d].buffers[i] = sclMallocWrite( hardList[d], CL_MEM_READ_ONLY, args[i].size, args[i].pointer );
+						sclSetKernelArg( softList[d], i, sizeof(cl_mem), &workers[d].buffers[i] );
+					}
+					else if ( args[i].kind == 'g' ) {
+						workers[d].buffers[i] = sclMalloc( hardList[d], CL_MEM_READ_WRITE, args[i].size );
+						sclSetKernelArg( softList[d], i, sizeof(cl_mem), &workers[d].buffers[i] );
+					}
 					break;
 				default:
 					break;
 			}
 		}
+		workers[d].chunkCount = 0;
+	}
+
+	for ( d = 0; d < found; ++d ) {
+		/* The chunks are shared, the devices that did start take the rest */
+		started[d] = pthread_create( &threads[d], NULL, _sclWorkerThread, &workers[d] ) == 0;
+		if ( !started[d] ) {
+			fprintf( stderr, "\nsclScheduleKernel: could not start the thread of device %d", d );
+		}
+		running += started[d];
+	}
+	if ( running == 0 ) {
+		_sclWorkerThread( &workers[0] );
+	}
+	for ( d = 0; d < found; ++d ) {
+		if ( started[d] ) {
+			pthread_join( threads[d], NULL );
+		}
+		if ( chunkCounts != NULL ) {
+			chunkCounts[d] = workers[d].chunkCount;
+		}
+		for ( i = 0; i < nArgs; ++i ) {
+			if ( workers[d].buffers[i] != NULL ) {
+				sclReleaseMemObject( workers[d].buffers[i] );
+			}
+		}
+		free( workers[d].buffers );
+	}
+
+	free( started );
+	free( threads );
+	free( workers );
+	free( args );
+
+	return nChunks;
+}
+
+/* Launch plans. The format string of a managed launch is compiled once: the
+   argument kinds and sizes are stored, the device buffers are created and bound
+   to the kernel, and the values of %a and %v arguments are remembered so that
+   later launches only call clSetKernelArg for the ones that changed. The plan
+   has a kernel object of its own, so launches of the sclSoft it was made from
+   can not change its arguments. */
+
+sclPlan* sclCreateLaunchPlan( sclHard hardware, sclSoft software, const char* sizesValues, ... ) {
+	va_list argList;
+	sclPlan* plan;
+	const char *p;
+	size_t valueBytes = 0;
+	int i;
+
+	plan = (sclPlan*)calloc( 1, sizeof(sclPlan) );
+	plan->hardware = hardware;
+	plan->software = software;
+	plan->software.kernel = NULL;
+
+	for( p = sizesValues; *p != '\0'; p++ ) {
+		if ( *p == '%' ) { plan->nArgs++; }
+	}
+	plan->args         = (_sclArgSpec*)calloc( plan->nArgs + 1, sizeof(_sclArgSpec) );
+	plan->buffers      = (cl_mem*)calloc( plan->nArgs + 1, sizeof(cl_mem) );
+	plan->valueOffsets = (size_t*)calloc( plan->nArgs + 1, sizeof(size_t) );
+	plan->bound        = (int*)calloc( plan->nArgs + 1, sizeof(int) );
+
+	va_start( argList, sizesValues );
+	i = 0;
+	for( p = sizesValues; *p != '\0'; p++ ) {
+		if ( *p != '%' ) {
+			continue;
+		}
+		if ( *( p + 1 ) == 'z' ) { /* Zero-copy hint, plan buffers are kept on the device */
+			p++;
+		}
+		plan->args[i].kind = *++p;
+		switch( *p ) {
+			case 'v':
+				plan->args[i].size = sizeof(cl_mem);
+				break;
+			case 'a':
+			case 'N':
+			case 'r':
+			case 'w':
+			case 'R':
+			case 'g':
+				plan->args[i].size = va_arg( argList, size_t );
+				break;
+			default: /* The values of the next arguments can not be found */
+				fprintf( stderr, "\nsclCreateLaunchPlan: unknown argument format %%%c", *p );
+				va_end( argList );
+				sclReleaseLaunchPlan( plan );
+				return NULL;
+		}
+		plan->valueOffsets[i] = valueBytes;
+		if ( *p == 'a' || *p == 'v' ) {
+			valueBytes += plan->args[i].size;
+		}
+		i++;
 	}
-	
 	va_end( argList );
+	plan->nArgs  = i;
+	plan->values = (unsigned char*)malloc( valueBytes > 0 ? valueBytes : 1 );
+
+	plan->software.kernel = _sclCreateKernel( software );
+	if ( plan->software.kernel == NULL ) {
+		fprintf( stderr, "\nsclCreateLaunchPlan: can not create a kernel for %s", software.kernelName );
+		sclReleaseLaunchPlan( plan );
+		return NULL;
+	}
 
-	event = sclLaunchKernel( hardware, software, global_work_size, local_work_size );
-	
-	for ( i = 0; i < outArgCount; i++ ) {
-		sclRead( hardware, sizesOut[i], outBuffs[i], outArgs[i] );		
+	/* Buffers and local memory never change, they are bound only here */
+	for ( i = 0; i < plan->nArgs; ++i ) {
+		switch ( plan->args[i].kind ) {
+			case 'N':
+				sclSetKernelArg( plan->software, i, plan->args[i].size, NULL );
+				break;
+			case 'r':
+				plan->buffers[i] = sclMalloc( hardware, CL_MEM_READ_ONLY, plan->args[i].size );
+				break;
+			case 'w':
+				plan->buffers[i] = sclMalloc( hardware, CL_MEM_WRITE_ONLY, plan->args[i].size );
+				break;
+			case 'R':
+			case 'g':
+				plan->buffers[i] = sclMalloc( hardware, CL_MEM_READ_WRITE, plan->args[i].size );
+				break;
+			default:
+				break;
+		}
+		if ( plan->buffers[i] != NULL ) {
+			sclSetKernelArg( plan->software, i, sizeof(cl_mem), &plan->buffers[i] );
+		}
 	}
 
-	sclFinish( hardware );
-	
-	for ( i = 0; i < outArgCount; i++ ) {
-		sclReleaseMemObject( outBuffs[i] );		
+	return plan;
+}
+
+cl_event sclLaunchPlan( sclPlan* plan, cl_uint work_dim, size_t *global_work_offset,
+			size_t *global_work_size, size_t *local_work_size, ... ) {
+	va_list argList;
+	cl_event event, *events;
+	unsigned char* value;
+	int i, nWriteEvents = 0, nReadEvents = 0;
+
+	events = (cl_event*)malloc( ( plan->nArgs + 1 ) * sizeof(cl_event) );
+
+	va_start( argList, local_work_size );
+	for ( i = 0; i < plan->nArgs; ++i ) {
+		switch ( plan->args[i].kind ) {
+			case 'a':
+			case 'v':
+				plan->args[i].pointer = va_arg( argList, void* );
+				value = plan->values + plan->valueOffsets[i];
+				if ( !plan->bound[i] || memcmp( value, plan->args[i].pointer, plan->args[i].size ) != 0 ) {
+					memcpy( value, plan->args[i].pointer, plan->args[i].size );
+					sclSetKernelArg( plan->software, i, plan->args[i].size, value );
+					plan->bound[i] = 1;
+				}
+				break;
+			case 'r':
+			case 'R':
+				plan->args[i].pointer = va_arg( argList, void* );
+				events[ nWriteEvents ] = sclWriteAsync( plan->hardware, 0, plan->args[i].size, plan->buffers[i],
+									plan->args[i].pointer, 0, NULL );
+				if ( events[ nWriteEvents ] != NULL ) { nWriteEvents++; }
+				break;
+			case 'w':
+				plan->args[i].pointer = va_arg( argList, void* );
+				break;
+			default:
+				break;
+		}
 	}
+	va_end( argList );
 
-	for ( i = 0; i < inArgCount; i++ ) {
-		sclReleaseMemObject( inBuffs[i] );
+	event = sclEnqueueKernelAsync( plan->hardware, plan->software, work_dim, global_work_offset, global_work_size,
+				       local_work_size, nWriteEvents, nWriteEvents > 0 ? events : NULL );
+	for ( i = 0; i < nWriteEvents; ++i ) {
+		sclReleaseEvent( events[i] );
+	}
+
+	for ( i = 0; i < plan->nArgs; ++i ) {
+		if ( plan->args[i].kind == 'w' || plan->args[i].kind == 'R' ) {
+			events[ nReadEvents ] = sclReadAsync( plan->hardware, 0, plan->args[i].size, plan->buffers[i], plan->args[i].pointer,
+							      event != NULL ? 1 : 0, event != NULL ? &event : NULL );
+			if ( events[ nReadEvents ] != NULL ) { nReadEvents++; }
+		}
+	}
+
+	if ( nReadEvents > 0 ) {
+		sclWaitForEvents( nReadEvents, events );
+	}
+	else if ( event != NULL ) {
+		sclWaitForEvents( 1, &event );
+	}
+	for ( i = 0; i < nReadEvents; ++i ) {
+		sclReleaseEvent( events[i] );
 	}
+	free( events );
 
 	return event;
 }
 
+void sclReleaseLaunchPlan( sclPlan* plan ) {
+	int i;
+
+	if ( plan == NULL ) {
+		return;
+	}
+	for ( i = 0; i < plan->nArgs; ++i ) {
+		if ( plan->buffers[i] != NULL ) {
+			sclReleaseMemObject( plan->buffers[i] );
+		}
+	}
+	if ( plan->software.kernel != NULL ) {
+		clReleaseKernel( plan->software.kernel );
+	}
+	free( plan->bound );
+	free( plan->valueOffsets );
+	free( plan->values );
+	free( plan->buffers );
+	free( plan->args );
+	free( plan );
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -26,10 +26,16 @@ extern "C" {
 #endif
 
 #include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <ctype.h>
+#include <pthread.h>
 
 #ifdef __APPLE__
 #include <OpenCL/opencl.h>
@@ -39,8 +45,13 @@ extern "C" {
 
 #define WORKGROUP_X 64
 #define WORKGROUP_Y 2
+
 #define DEBUG
 
+/* Metrics of sclGetDeviceScore and sclGetBestDevice */
+#define SCL_SCORE_FLOPS 0
+#define SCL_SCORE_BANDWIDTH 1
+
 #ifndef _OCLUTILS_STRUCTS
 typedef struct {
 	cl_platform_id platform;
@@ -51,6 +62,9 @@ typedef struct {
 	unsigned long int maxPointerSize;
 	cl_device_type deviceType;
 	int devNum;
+	int unifiedMemory;
+	cl_command_queue* queues;
+	int nQueues;
 }sclHard;
 typedef sclHard* ptsclHard;
 typedef struct {
@@ -59,6 +73,49 @@ typedef struct {
 	char kernelName[98];	
 }sclSoft;
 
+typedef struct {
+	unsigned long hits;
+	unsigned long misses;
+	size_t bytesCached;
+	size_t bytesInUse;
+	double hitRate;
+}sclPoolStats;
+
+typedef struct {
+	size_t chunks;
+	size_t bytesIn;
+	size_t bytesOut;
+	double seconds;
+	double throughput;
+}sclStreamStats;
+
+typedef struct {
+	sclHard hardware;
+	cl_mem buffer;
+	void* host;
+	size_t size;
+	int hostDirty;
+	int deviceDirty;
+}sclBuffer;
+
+typedef struct {
+	char kind;
+	int partitioned;
+	size_t size;
+	void* pointer;
+}_sclArgSpec;
+
+typedef struct {
+	sclHard hardware;
+	sclSoft software;
+	int nArgs;
+	_sclArgSpec* args;
+	cl_mem* buffers;
+	unsigned char* values;
+	size_t* valueOffsets;
+	int* bound;
+}sclPlan;
+
 extern sclHard* _sclHardList;
 extern int _sclHardListLength;
 #define _OCLUTILS_STRUCTS
@@ -71,18 +128,84 @@ cl_mem 			sclMalloc( sclHard hardware, cl_int mode, size_t size );
 cl_mem 			sclMallocWrite( sclHard hardware, cl_int mode, size_t size, void* hostPointer );
 void 			sclWrite( sclHard hardware, size_t size, cl_mem buffer, void* hostPointer );
 void			sclRead( sclHard hardware, size_t size, cl_mem buffer, void *hostPointer );
+cl_event		sclWriteAsync( sclHard hardware, size_t offset, size_t size, cl_mem buffer, void* hostPointer,
+				       cl_uint num_events_in_wait_list, const cl_event *event_wait_list );
+cl_event		sclReadAsync( sclHard hardware, size_t offset, size_t size, cl_mem buffer, void* hostPointer,
+				      cl_uint num_events_in_wait_list, const cl_event *event_wait_list );
+cl_mem			sclMallocWriteAsync( sclHard hardware, cl_int mode, size_t size, void* hostPointer, cl_event* event );
+void			sclWriteOffset( sclHard hardware, size_t offset, size_t size, cl_mem buffer, void* hostPointer );
+void			sclReadOffset( sclHard hardware, size_t offset, size_t size, cl_mem buffer, void* hostPointer );
+void			sclWriteRect( sclHard hardware, cl_mem buffer, const size_t* bufferOrigin, const size_t* hostOrigin,
+				      const size_t* region, size_t bufferRowPitch, size_t bufferSlicePitch,
+				      size_t hostRowPitch, size_t hostSlicePitch, void* hostPointer );
+void			sclReadRect( sclHard hardware, cl_mem buffer, const size_t* bufferOrigin, const size_t* hostOrigin,
+				     const size_t* region, size_t bufferRowPitch, size_t bufferSlicePitch,
+				     size_t hostRowPitch, size_t hostSlicePitch, void* hostPointer );
+cl_mem			sclCreateSubBuffer( sclHard hardware, cl_mem buffer, cl_mem_flags mode, size_t origin, size_t size );
+
+/* ######################################################## */
+
+/* ####### Multiple queues per device #################### */
+
+int			sclCreateQueues( sclHard* hardware, int nQueues, int outOfOrder );
+sclHard			sclSelectQueue( sclHard hardware, int index );
+sclHard			sclNextQueue( sclHard hardware );
+void			sclReleaseQueues( sclHard* hardware );
+
+/* ######################################################## */
+
+/* ####### Zero-copy host memory ######################### */
+
+cl_mem			sclMallocHost( sclHard hardware, cl_int mode, size_t size, void* hostPointer );
+void*			sclMap( sclHard hardware, cl_mem buffer, cl_map_flags flags, size_t offset, size_t size );
+void			sclUnmap( sclHard hardware, cl_mem buffer, void* mappedPointer );
+void*			sclHostAlloc( sclHard hardware, size_t size );
+void			sclHostFree( void* pointer );
+void			sclTrimHostPool( size_t maxCachedBytes );
+void			sclSetHostPoolLimit( size_t maxCachedBytes );
+
+/* ######################################################## */
+
+/* ####### Managed buffers ################################ */
+
+sclBuffer*		sclCreateBuffer( sclHard hardware, cl_int mode, size_t size, void* hostPointer );
+cl_mem			sclBufferDevice( sclBuffer* buffer );
+void*			sclBufferHost( sclBuffer* buffer );
+void			sclBufferHostModified( sclBuffer* buffer );
+void			sclBufferDeviceModified( sclBuffer* buffer );
+void			sclReleaseBuffer( sclBuffer* buffer );
+
+/* ######################################################## */
+
+/* ####### Device buffer pool ############################# */
+
+void			sclTrimBufferPool( size_t maxCachedBytes );
+void			sclSetBufferPoolLimit( size_t maxCachedBytes );
+sclPoolStats		sclGetBufferPoolStats( void );
 
 /* ######################################################## */
 
 /* ####### inicialization of sclSoft structs  ############## */
 
 sclSoft 		sclGetCLSoftware( char* path, char* name, sclHard hardware );
+sclSoft 		sclGetCLSoftwareOptions( char* path, char* name, sclHard hardware, const char* options );
+sclSoft*		sclGetAllSoftware( char* path, sclHard hardware, int* found );
+sclSoft			sclGetSoftwareByName( sclSoft* softList, int found, const char* name );
 
 /* ######################################################## */
 
+/* ####### Program binary cache ######################### */
+
+void			sclSetBinaryCacheDir( const char* dir );
+void			sclInvalidateBinaryCache( void );
+void			sclGetBinaryCacheStats( unsigned long* hits, unsigned long* misses );
+
+/* ######################################################## */
+
 /* ####### Release and retain OpenCL objects ############## */
 
 void 			sclReleaseClSoft( sclSoft soft );
+void			sclReleaseAllSoftware( sclSoft* softList, int found );
 void 			sclReleaseClHard( sclHard hard );
 void 			sclRetainClHard( sclHard hardware );
 void 			sclReleaseAllHardware( sclHard* hardList, int found );
@@ -109,12 +232,64 @@ cl_event		sclSetArgsEnqueueKernel( sclHard hardware, sclSoft software, size_t *g
 						 const char* sizesValues, ... );
 cl_event		sclManageArgsLaunchKernel( sclHard hardware, sclSoft software, size_t *global_work_size, size_t *local_work_size,
 						   const char* sizesValues, ... );
+cl_event		sclLaunchKernelND( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_offset,
+					   size_t *global_work_size, size_t *local_work_size );
+cl_event		sclEnqueueKernelND( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_offset,
+					    size_t *global_work_size, size_t *local_work_size );
+cl_event		sclSetArgsLaunchKernelND( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_offset,
+						  size_t *global_work_size, size_t *local_work_size, const char* sizesValues, ... );
+cl_event		sclSetArgsEnqueueKernelND( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_offset,
+						   size_t *global_work_size, size_t *local_work_size, const char* sizesValues, ... );
+cl_event		sclManageArgsLaunchKernelND( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_offset,
+						     size_t *global_work_size, size_t *local_work_size, const char* sizesValues, ... );
+cl_event		sclEnqueueKernelAsync( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_offset,
+					       size_t *global_work_size, size_t *local_work_size,
+					       cl_uint num_events_in_wait_list, const cl_event *event_wait_list );
 
 /* ######################################################## */
 
+/* ####### Multi-device execution ######################### */
+
+int			sclManageArgsLaunchKernelMulti( sclHard* hardList, sclSoft* softList, int found, cl_uint work_dim,
+							size_t *global_work_size, size_t *local_work_size, const char* sizesValues, ... );
+double			sclGetDeviceRate( sclHard hardware, sclSoft software );
+size_t			sclScheduleKernel( sclHard* hardList, sclSoft* softList, int found, size_t nItems, size_t chunkItems,
+					   size_t *local_work_size, int* chunkCounts, const char* sizesValues, ... );
+
+/* ######################################################## */
+
+/* ####### Launch plans ################################### */
+
+sclPlan*		sclCreateLaunchPlan( sclHard hardware, sclSoft software, const char* sizesValues, ... );
+cl_event		sclLaunchPlan( sclPlan* plan, cl_uint work_dim, size_t *global_work_offset,
+				       size_t *global_work_size, size_t *local_work_size, ... );
+void			sclReleaseLaunchPlan( sclPlan* plan );
+
+/* ######################################################## */
+
+/* ####### Streaming execution ############################ */
+
+sclStreamStats		sclStreamLaunchKernel( sclHard hardware, sclSoft software, size_t nItems, size_t chunkItems, int nSlots,
+					       size_t *local_work_size, const char* sizesValues, ... );
+
+/* ######################################################## */
+
+/* ####### Local work size autotuner ###################### */
+
+void			sclSetAutotune( int enable );
+void			sclSetTuningFile( const char* filename );
+void			sclSetKernelAutotune( sclSoft software, int enable );
+
+/* ######################################################## */
+
 /* ####### Event queries ################################## */
 
 cl_ulong 		sclGetEventTime( sclHard hardware, cl_event event );
+cl_int			sclSetEventCallback( cl_event event, void (CL_CALLBACK *callback)( cl_event, cl_int, void* ), void* userData );
+cl_int			sclWaitForEvents( cl_uint num_events, const cl_event *event_list );
+void			sclReleaseEvent( cl_event event );
+void			sclProfilerDump( FILE* out, int json );
+int			sclWriteTrace( const char* filename );
 
 /* ######################################################## */
 
@@ -137,6 +312,14 @@ sclHard 		sclGetGPUHardware( int nDevice, int* found );
 sclHard 		sclGetCPUHardware( int nDevice, int* found );
 sclHard*		sclGetAllHardware( int* found );
 sclHard 		sclGetFastestDevice( sclHard* hardList, int found );
+sclHard*		sclDiscoverHardware( int* found );
+int			sclOpenHardware( sclHard* hardware );
+void			sclSetInventoryFile( const char* filename );
+double			sclGetDeviceScore( sclHard* hardware, int metric );
+sclHard			sclGetBestDevice( sclHard* hardList, int found, int metric );
+sclHard			sclGetBestDeviceForKernel( sclHard* hardList, int found, int* selected, char* path, char* name,
+						   cl_uint work_dim, size_t *global_work_size, size_t *local_work_size,
+						   const char* sizesValues, ... );
 
 /* ######################################################## */
 
@@ -145,15 +328,106 @@ sclHard 		sclGetFastestDevice( sclHard* hardList, int found );
 /* ####### debug ########################################## */
 
 void 			_sclWriteArgOnAFile( int argnum, void* arg, size_t size, const char* diff );
+double			_sclGetWallTime( void );
+
+/* ######################################################## */
+
+/* ####### local work size autotuner ##################### */
+
+int			_sclAutotuneEnabled( void );
+int			_sclKernelAutotuned( const char* kernelName );
+const char*		_sclGetTuningFile( void );
+cl_ulong		_sclGetDeviceHash( cl_device_id device );
+cl_ulong		_sclGetOptionsHash( sclSoft software, cl_device_id device );
+void			_sclLoadTuningFile( void );
+double			_sclTimeLocalSize( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_offset,
+					   size_t *global_work_size, size_t *local_work_size,
+					   cl_uint num_events_in_wait_list, const cl_event *event_wait_list );
+int			_sclSizeClass( size_t size );
+size_t*			_sclTunedLocalSize( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_offset,
+					    size_t *global_work_size, size_t *tuned,
+					    cl_uint num_events_in_wait_list, const cl_event *event_wait_list );
+
+/* ######################################################## */
+
+/* ####### event profiler ################################ */
+
+void			_sclProfileInit( void );
+void			_sclProfileAtExit( void );
+int			_sclProfilerEnabled( void );
+cl_event*		_sclProfileSlot( cl_event* event );
+void			_sclProfileRecord( const char* name, size_t bytes, cl_ulong queued, cl_ulong submit, cl_ulong start, cl_ulong end );
+void CL_CALLBACK	_sclProfileCallback( cl_event event, cl_int status, void* data );
+void			_sclProfileCommand( sclHard hardware, cl_event event, const char* name, const char* category, size_t bytes );
+int			_sclCompareTimes( const void* a, const void* b );
+
+/* ######################################################## */
+
+/* ####### multi-device scheduling ######################## */
+
+double			_sclGetDeviceRate( const char* kernelName, int devNum );
+void			_sclUpdateDeviceRate( const char* kernelName, int devNum, double itemsPerSecond );
+cl_ulong		_sclGetEventSpan( cl_event* events, int nEvents );
+cl_uint			_sclGetMemBaseAddrAlign( cl_device_id device );
+size_t			_sclGreatestCommonDivisor( size_t a, size_t b );
+void*			_sclWorkerThread( void* data );
+
+/* ######################################################## */
+
+/* ####### kernel arguments ############################### */
+
+void			_sclVSetKernelArgs( sclSoft software, const char *sizesValues, va_list argList );
+int			_sclParseArgs( const char* sizesValues, va_list argList, _sclArgSpec** args );
+void			_sclStreamCopyOut( _sclArgSpec* args, int nArgs, void** staging, size_t start, size_t count );
+int			_sclCheckManagedArgs( sclHard hardware, const char* sizesValues, va_list argList );
+cl_event		_sclVManageArgsLaunchKernel( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_offset,
+						     size_t *global_work_size, size_t *local_work_size, const char* sizesValues, va_list argList );
 
 /* ######################################################## */
 
+/* ####### device buffer pool ############################# */
+
+size_t			_sclPoolSizeClass( size_t size );
+int			_sclIsOutOfOrderQueue( cl_command_queue queue );
+int			_sclPoolReleaseMarkers( cl_context context, cl_command_queue queue, cl_event** events );
+cl_mem			_sclCreateBuffer( sclHard hardware, cl_int mode, size_t size, cl_int* err );
+int			_sclPoolRelease( cl_mem object );
+void			_sclPoolTrim( size_t maxCachedBytes );
+void			_sclPoolDetach( cl_mem object );
+void			_sclPoolDropQueue( cl_command_queue queue );
+size_t			_sclGetPageSize( void );
+int			_sclIsPageAligned( const void* pointer );
+void			_sclHostTrim( size_t maxCachedBytes );
+int			_sclIsHostAllocated( const void* pointer, size_t size );
+void			_sclHostDropQueue( cl_command_queue queue );
+void*			_sclMapBuffer( sclHard hardware, cl_mem buffer, cl_map_flags flags, size_t offset, size_t size,
+				       cl_uint num_events_in_wait_list, const cl_event *event_wait_list );
+
+/* ######################################################## */
+
 /* ####### cl software management ######################### */
 
-void 			_sclBuildProgram( cl_program program, cl_device_id devices, const char* pName );
+cl_int 			_sclBuildProgram( cl_program program, cl_device_id device, const char* options, const char* pName );
 cl_kernel 		_sclCreateKernel( sclSoft software );
 cl_program 		_sclCreateProgram( char* program_source, cl_context context );
+cl_uint			_sclGetContextDeviceCount( cl_context context );
 char* 			_sclLoadProgramSource( const char *filename );
+cl_program		_sclGetCachedProgram( const char* source, const char* options, sclHard hardware, const char* pName );
+cl_program		_sclGetRegisteredProgram( const char* path, const char* options, sclHard hardware, const char* pName );
+void			_sclRetainRegisteredProgram( cl_program program );
+int			_sclReleaseRegisteredProgram( cl_program program );
+char*			_sclStrDup( const char* str );
+char*			_sclNormalizeOptions( const char* options );
+
+/* ######################################################## */
+
+/* ####### program binary cache ########################### */
+
+const char*		_sclGetBinaryCacheDir( void );
+cl_ulong		_sclHashString( cl_ulong hash, const char* str );
+int			_sclBinaryCachePath( char* filename, size_t length, const char* source, const char* options, cl_device_id device );
+cl_program		_sclLoadProgramBinary( const char* filename, cl_context context, cl_device_id device, const char* options );
+void			_sclStoreProgramBinary( const char* filename, cl_program program, cl_device_id device );
 
 /* ######################################################## */
 
@@ -162,8 +436,24 @@ char* 			_sclLoadProgramSource( const char *filename );
 int									_sclGetMaxComputeUnits( cl_device_id device );
 unsigned long int 	_sclGetMaxMemAllocSize( cl_device_id device );
 cl_device_type 			_sclGetDeviceType( cl_device_id device );
+int			_sclGetHostUnifiedMemory( cl_device_id device );
 void					 			_sclSmartCreateContexts( sclHard* hardList, int found );
 void					 			_sclCreateQueues( sclHard* hardList, int found );
+int			_sclIsListed( sclHard* hardware );
+int*			_sclQueueRefCount( int devNum );
+void			_sclFreeQueues( cl_command_queue* queues, int nQueues );
+const char*		_sclGetInventoryFile( void );
+cl_ulong		_sclGetPlatformHash( cl_platform_id platform );
+void*			_sclQueryDevice( void* arg );
+void*			_sclHashDevice( void* arg );
+int			_sclLoadInventory( sclHard* hardList, int found, const int* platformIndex, const int* deviceIndex,
+					   const cl_ulong* platformHash, const int* platformDevices, const cl_ulong* deviceHash );
+void			_sclStoreInventory( sclHard* hardList, int found, const int* platformIndex, const int* deviceIndex,
+					    const cl_ulong* platformHash, const int* platformDevices, const cl_ulong* deviceHash );
+void			_sclDiscoverDevices( void );
+void			_sclLoadScores( void );
+double			_sclTimeParsedArgs( sclHard hardware, sclSoft software, cl_uint work_dim, size_t *global_work_size,
+					    size_t *local_work_size, _sclArgSpec* args, int nArgs );
 
 /* ######################################################## */
 
@@ -0,0 +1,236 @@
+/* #######################################################################
+    Copyright 2011 Oscar Amoros Huguet, Cristian Garcia Marin
+
+    This file is part of SimpleOpenCL
+
+    SimpleOpenCL is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 3.
+
+    SimpleOpenCL is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SimpleOpenCL. If not, see <http://www.gnu.org/licenses/>.
+
+   #######################################################################
+
+   SimpleOpenCL Version 0.010_27_02_2013
+
+   C++ launch layer. Header only, it needs C++11. Argument sizes and roles are
+   deduced from the argument types, so there is no format string:
+
+     scalar values (int, float, cl_float4, structs...)  ->  by value, sizeof(T)
+     cl_mem                                             ->  buffer argument
+     scl::local<T>( n )                                 ->  __local T[n]
+
+   scl::launch sets every argument and launches the kernel. scl::kernel<...>
+   is declared with the kernel parameter types, checks the arguments of every
+   launch at compile time and only sets the ones that changed.
+
+*/
+
+#ifndef _SIMPLECL_HPP
+#define _SIMPLECL_HPP
+
+#if __cplusplus < 201103L
+#error "simpleCL.hpp needs C++11"
+#endif
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+
+#include "simpleCL.h"
+
+namespace scl {
+
+/* ####### NDRange ####################################### */
+
+struct range {
+	cl_uint dims;
+	size_t global[3];
+	size_t localSize[3];
+	size_t offsetSize[3];
+	bool hasLocal;
+	bool hasOffset;
+
+	range( size_t x ) : dims( 1 ), global{ x, 1, 1 }, localSize{ 1, 1, 1 }, offsetSize{ 0, 0, 0 },
+			    hasLocal( false ), hasOffset( false ) {}
+	range( size_t x, size_t y ) : dims( 2 ), global{ x, y, 1 }, localSize{ 1, 1, 1 }, offsetSize{ 0, 0, 0 },
+				      hasLocal( false ), hasOffset( false ) {}
+	range( size_t x, size_t y, size_t z ) : dims( 3 ), global{ x, y, z }, localSize{ 1, 1, 1 }, offsetSize{ 0, 0, 0 },
+						hasLocal( false ), hasOffset( false ) {}
+
+	range& local( size_t x, size_t y = 1, size_t z = 1 ) {
+		localSize[0] = x; localSize[1] = y; localSize[2] = z;
+		hasLocal = true;
+		return *this;
+	}
+	range& offset( size_t x, size_t y = 0, size_t z = 0 ) {
+		offsetSize[0] = x; offsetSize[1] = y; offsetSize[2] = z;
+		hasOffset = true;
+		return *this;
+	}
+};
+
+/* ####### Argument types ################################ */
+
+template <typename T>
+struct local {
+	size_t count;
+	explicit local( size_t n ) : count( n ) {}
+};
+
+/* How every argument type is passed to clSetKernelArg */
+template <typename T, typename Enable = void>
+struct arg_traits {
+	static_assert( !std::is_pointer<T>::value && !std::is_array<T>::value,
+		       "host pointers can not be kernel arguments, pass a cl_mem instead" );
+	static_assert( std::is_trivially_copyable<T>::value,
+		       "kernel arguments passed by value must be trivially copyable" );
+	static const size_t cacheSize = sizeof(T);
+	static size_t size( const T& ) { return sizeof(T); }
+	static const void* value( const T& arg ) { return &arg; }
+};
+
+template <>
+struct arg_traits<cl_mem> {
+	static const size_t cacheSize = sizeof(cl_mem);
+	static size_t size( const cl_mem& ) { return sizeof(cl_mem); }
+	static const void* value( const cl_mem& arg ) { return &arg; }
+};
+
+template <typename T>
+struct arg_traits< local<T> > {
+	static const size_t cacheSize = sizeof(size_t);
+	static size_t size( const local<T>& arg ) { return arg.count * sizeof(T); }
+	static const void* value( const local<T>& ) { return NULL; }
+};
+
+/* ####### Internal helpers ############################## */
+
+namespace detail {
+
+template <typename T>
+struct decay_arg { typedef typename std::remove_cv<typename std::remove_reference<T>::type>::type type; };
+
+template <typename... T>
+struct all_true : std::true_type {};
+
+template <typename... T>
+struct all_true<std::false_type, T...> : std::false_type {};
+
+template <typename... T>
+struct all_true<std::true_type, T...> : all_true<T...> {};
+
+template <typename... T>
+struct cache_bytes { static const size_t value = 0; };
+
+template <typename T, typename... Rest>
+struct cache_bytes<T, Rest...> { static const size_t value = arg_traits<T>::cacheSize + cache_bytes<Rest...>::value; };
+
+inline void set_arg( cl_kernel kernel, cl_uint index, size_t size, const void* value ) {
+	cl_int err = clSetKernelArg( kernel, index, size, value );
+	if ( err != CL_SUCCESS ) {
+		fprintf( stderr, "\nError clSetKernelArg number %u\n", index );
+		sclPrintErrorFlags( err );
+	}
+}
+
+inline void set_args( cl_kernel, cl_uint ) {}
+
+template <typename T, typename... Rest>
+inline void set_args( cl_kernel kernel, cl_uint index, const T& arg, const Rest&... rest ) {
+	typedef typename decay_arg<T>::type type;
+	set_arg( kernel, index, arg_traits<type>::size( arg ), arg_traits<type>::value( arg ) );
+	set_args( kernel, index + 1, rest... );
+}
+
+inline cl_event enqueue( sclHard hardware, sclSoft software, range& r ) {
+	return sclEnqueueKernelND( hardware, software, r.dims, r.hasOffset ? r.offsetSize : NULL,
+				   r.global, r.hasLocal ? r.localSize : NULL );
+}
+
+} /* namespace detail */
+
+/* ####### Stateless launch ############################## */
+
+/* Sets every argument and enqueues the kernel without waiting */
+template <typename... Args>
+inline cl_event enqueue( sclHard hardware, sclSoft software, range r, const Args&... args ) {
+	detail::set_args( software.kernel, 0, args... );
+	return detail::enqueue( hardware, software, r );
+}
+
+/* Same as enqueue, but waits for the kernel like sclLaunchKernel */
+template <typename... Args>
+inline cl_event launch( sclHard hardware, sclSoft software, range r, const Args&... args ) {
+	cl_event event = enqueue( hardware, software, r, args... );
+	sclFinish( hardware );
+	return event;
+}
+
+/* ####### Typed kernel with argument cache ############### */
+
+template <typename... Params>
+class kernel {
+public:
+	kernel( sclHard hardware, sclSoft software ) : hardware_( hardware ), software_( software ) {
+		std::memset( bound_, 0, sizeof(bound_) );
+	}
+
+	sclSoft software() const { return software_; }
+
+	/* Forget the cached values, for instance after setting arguments by other means */
+	void invalidate() { std::memset( bound_, 0, sizeof(bound_) ); }
+
+	template <typename... Args>
+	cl_event enqueue( range r, const Args&... args ) {
+		static_assert( sizeof...(Args) == sizeof...(Params), "wrong number of kernel arguments" );
+		static_assert( detail::all_true< typename std::is_convertible<Args, Params>::type... >::value,
+			       "kernel argument type does not match the kernel signature" );
+		bind<0, 0, Params...>( args... );
+		return detail::enqueue( hardware_, software_, r );
+	}
+
+	template <typename... Args>
+	cl_event operator()( range r, const Args&... args ) {
+		cl_event event = enqueue( r, args... );
+		sclFinish( hardware_ );
+		return event;
+	}
+
+private:
+	template <cl_uint Index, size_t Offset>
+	void bind() {}
+
+	template <cl_uint Index, size_t Offset, typename P, typename... Rest, typename A, typename... ARest>
+	void bind( const A& arg, const ARest&... rest ) {
+		const P value = arg;
+		const size_t size = arg_traits<P>::size( value );
+		const void* bytes = arg_traits<P>::value( value );
+		unsigned char* cached = cache_ + Offset;
+
+		/* Local memory is cached by size, the rest by value */
+		const void* key = bytes != NULL ? bytes : static_cast<const void*>( &size );
+		if ( !bound_[ Index ] || std::memcmp( cached, key, arg_traits<P>::cacheSize ) != 0 ) {
+			std::memcpy( cached, key, arg_traits<P>::cacheSize );
+			detail::set_arg( software_.kernel, Index, size, bytes );
+			bound_[ Index ] = true;
+		}
+		bind<Index + 1, Offset + arg_traits<P>::cacheSize, Rest...>( rest... );
+	}
+
+	sclHard hardware_;
+	sclSoft software_;
+	bool bound_[ sizeof...(Params) + 1 ];
+	unsigned char cache_[ detail::cache_bytes<Params...>::value + 1 ];
+};
+
+} /* namespace scl */
+
+#endif